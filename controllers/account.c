@@ -1,5 +1,98 @@
+#include <apr_thread_mutex.h>
 #include "base.h"
 
+/* Sessions known to exist, kept per server process */
+#define SESSION_CACHE_SIZE 4096
+
+/* Entries per bucket, the least recently used is replaced */
+#define SESSION_CACHE_WAYS 4
+
+typedef struct CachedSession
+{
+	row_id_t sessionId; // 0 if the entry is free
+	row_id_t userId;
+	apr_uint32_t lastUsed;
+} CachedSession;
+
+static struct
+{
+	apr_thread_mutex_t *mutex;
+	CachedSession *entries;
+	apr_uint32_t clock;
+} sessions;
+
+static void init_session_cache(void)
+{
+	apr_pool_t *pool = NULL;
+	apr_thread_mutex_t *mutex = NULL;
+
+	if (apr_pool_create(&pool, NULL) != APR_SUCCESS ||
+		apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to initialise the session cache");
+		return;
+	}
+
+	sessions.entries = apr_pcalloc(pool, SESSION_CACHE_SIZE * sizeof(CachedSession));
+	sessions.mutex = mutex; // must come last
+}
+
+static CachedSession *session_bucket(row_id_t sessionId)
+{
+	unsigned long long hash = (unsigned long long)sessionId * 11400714819323198485ull;
+	size_t buckets = SESSION_CACHE_SIZE / SESSION_CACHE_WAYS;
+	return &sessions.entries[(size_t)(hash >> 32) % buckets * SESSION_CACHE_WAYS];
+}
+
+static bool is_session_cached(row_id_t sessionId, row_id_t userId)
+{
+	if (sessions.mutex == NULL)
+		return false;
+
+	bool found = false;
+	apr_thread_mutex_lock(sessions.mutex);
+
+	CachedSession *bucket = session_bucket(sessionId);
+	for (int i = 0; i < SESSION_CACHE_WAYS; i++)
+	{
+		if (bucket[i].sessionId == sessionId && bucket[i].userId == userId)
+		{
+			bucket[i].lastUsed = ++sessions.clock;
+			found = true;
+			break;
+		}
+	}
+	apr_thread_mutex_unlock(sessions.mutex);
+	return found;
+}
+
+static void cache_session(row_id_t sessionId, row_id_t userId)
+{
+	if (sessions.mutex == NULL)
+		return;
+
+	apr_thread_mutex_lock(sessions.mutex);
+
+	CachedSession *bucket = session_bucket(sessionId);
+	CachedSession *entry = &bucket[0];
+	for (int i = 0; i < SESSION_CACHE_WAYS; i++)
+	{
+		if (bucket[i].sessionId == sessionId || bucket[i].sessionId == 0)
+		{
+			entry = &bucket[i];
+			break;
+		}
+		// compared by age, so that the clock can wrap around
+		if (sessions.clock - bucket[i].lastUsed > sessions.clock - entry->lastUsed)
+			entry = &bucket[i];
+	}
+	entry->sessionId = sessionId;
+	entry->userId = userId;
+	entry->lastUsed = ++sessions.clock;
+
+	apr_thread_mutex_unlock(sessions.mutex);
+}
+
 static errno_t user_query_callback(void *context, int argc, char **argv, char **columns)
 {
 	CHECK_SQL_CALLBACK(1);
@@ -15,6 +108,10 @@ apr_status_t ensure_session_exists(HttpContext *c)
 	row_id_t sessionId = str_to_long(c->identity.sid);
 	row_id_t userId = 0;
 
+	// Sessions are never deleted, so once seen there is no need to check again
+	if (is_session_cached(sessionId, str_to_long(c->identity.sub)))
+		return OK;
+
 	// Check if the session exists in the database
 	DbQuery query = {.dbc = &c->dbc};
 	query.callback = user_query_callback;
@@ -28,7 +125,10 @@ apr_status_t ensure_session_exists(HttpContext *c)
 		return http_problem(c, NULL, tl("Failed to check session existence"), HTTP_INTERNAL_SERVER_ERROR);
 
 	if (userId != 0)
+	{
+		cache_session(sessionId, userId);
 		return OK; // session exists, all good
+	}
 
 	// Session not found, need to recreate it
 	userId = str_to_long(c->identity.sub);
@@ -37,7 +137,7 @@ apr_status_t ensure_session_exists(HttpContext *c)
 	get_ip_addr(c->request, ip_addr, sizeof(ip_addr));
 
 	query.callback = NULL;
-	query.sql = "INSERT INTO `Users` (Id, Type) VALUES (?, ?);";
+	query.sql = "INSERT IGNORE INTO `Users` (Id, Type) VALUES (?, ?);";
 	query.argc = 0;
 	argv[query.argc++] = json_new_long(userId, false);
 	argv[query.argc++] = json_new_int(UserType_Anonymous, false);
@@ -45,7 +145,7 @@ apr_status_t ensure_session_exists(HttpContext *c)
 	if (sql_exec(&query, argv) != 0)
 		return http_problem(c, NULL, tl("Failed to create user entry"), HTTP_INTERNAL_SERVER_ERROR);
 
-	query.sql = "INSERb INTO `Sessions` (Id, UserId, IPAddress) VALUES (?, ?, ?);";
+	query.sql = "INSERT INTO `Sessions` (Id, UserId, IPAddress) VALUES (?, ?, ?);";
 	query.argc = 0;
 	argv[query.argc++] = json_new_long(sessionId, false);
 	argv[query.argc++] = json_new_long(userId, false);
@@ -54,6 +154,8 @@ apr_status_t ensure_session_exists(HttpContext *c)
 	if (sql_exec(&query, argv) != 0)
 		return http_problem(c, NULL, tl("Failed to recreate user session"), HTTP_INTERNAL_SERVER_ERROR);
 
+	cache_session(sessionId, userId);
+
 	APP_LOG(LOG_INFO, "Recreated session %lld for user %lld", sessionId, userId);
 	return OK;
 }
@@ -107,6 +209,8 @@ static apr_status_t anonymous_login(HttpContext *c, const char *password, Access
 	snprintf(auth->sub, sizeof(auth->sub), "%lld", userId);
 	snprintf(auth->sid, sizeof(auth->sid), "%lld", sessionId);
 
+	cache_session(sessionId, userId);
+
 	APP_LOG(LOG_INFO, "Created session %lld for user %lld", sessionId, userId);
 	return OK;
 }
@@ -153,6 +257,7 @@ static apr_status_t logout(HttpContext *c)
 
 void register_account_controller(void)
 {
+	init_session_cache();
 	add_endpoint(M_POST, "/api/account/login", login, Endpoint_IsaWebAPI);
 	add_endpoint(M_POST, "/api/account/logout", logout, Endpoint_AuthWebAPI);
 }
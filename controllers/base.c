@@ -0,0 +1,198 @@
+#include <apr_strings.h>
+#include <http_protocol.h>
+#include "base.h"
+
+void make_etag(char etag[ETAG_STORE], char prefix, const char *data)
+{
+	// FNV-1a, good enough to tell responses apart
+	unsigned long long hash = 14695981039346656037ULL;
+	for (const char *s = data; *s; s++)
+	{
+		hash ^= (unsigned char)*s;
+		hash *= 1099511628211ULL;
+	}
+	sprintf(etag, "\"%c%016llx\"", prefix, hash);
+}
+
+bool etag_matches(HttpContext *c, const char *etag)
+{
+	request_rec *r = c->request;
+	apr_table_setn(r->headers_out, "ETag", apr_pstrdup(r->pool, etag));
+	apr_table_setn(r->headers_out, "Cache-Control", "no-cache");
+
+	const char *match = apr_table_get(r->headers_in, "If-None-Match");
+	if (str_empty(match))
+		return false;
+
+	return str_equal(match, "*") || strstr(match, etag) != NULL;
+}
+
+void jw_init(JsonWriter *w, HttpContext *c)
+{
+	w->request = c->request;
+	w->sent = false;
+	w->comma = false;
+	w->depth = 0;
+	w->used = 0;
+}
+
+static void jw_flush(JsonWriter *w)
+{
+	if (w->used == 0)
+		return;
+
+	if (!w->sent)
+		ap_set_content_type(w->request, "application/json; charset=utf-8");
+
+	ap_rwrite(w->buffer, (int)w->used, w->request);
+	w->sent = true;
+	w->used = 0;
+}
+
+static void jw_write(JsonWriter *w, const char *data, apr_size_t size)
+{
+	if (w->used + size > sizeof(w->buffer))
+	{
+		jw_flush(w);
+
+		if (size > sizeof(w->buffer))
+		{
+			ap_rwrite(data, (int)size, w->request);
+			return;
+		}
+	}
+	memcpy(w->buffer + w->used, data, size);
+	w->used += size;
+}
+
+static void jw_escaped(JsonWriter *w, const char *s)
+{
+	jw_write(w, "\"", 1);
+
+	const char *start = s;
+	for (; *s; s++)
+	{
+		unsigned char ch = (unsigned char)*s;
+		if (ch >= 0x20 && ch != '"' && ch != '\\')
+			continue;
+
+		jw_write(w, start, (apr_size_t)(s - start));
+		start = s + 1;
+
+		char esc[8];
+		switch (ch)
+		{
+			case '"': strcpy(esc, "\\\""); break;
+			case '\\': strcpy(esc, "\\\\"); break;
+			case '\n': strcpy(esc, "\\n"); break;
+			case '\r': strcpy(esc, "\\r"); break;
+			case '\t': strcpy(esc, "\\t"); break;
+			case '\b': strcpy(esc, "\\b"); break;
+			case '\f': strcpy(esc, "\\f"); break;
+			default: sprintf(esc, "\\u%04x", ch); break;
+		}
+		jw_write(w, esc, strlen(esc));
+	}
+	jw_write(w, start, (apr_size_t)(s - start));
+	jw_write(w, "\"", 1);
+}
+
+/* Write what comes before a value */
+static void jw_name(JsonWriter *w, const char *name)
+{
+	if (w->comma)
+		jw_write(w, ",", 1);
+
+	if (name != NULL)
+	{
+		jw_escaped(w, name);
+		jw_write(w, ":", 1);
+	}
+	w->comma = true;
+}
+
+void jw_begin(JsonWriter *w, const char *name, char bracket)
+{
+	if (w->depth > 0)
+		jw_name(w, name);
+
+	jw_write(w, &bracket, 1);
+	w->comma = false;
+	w->depth++;
+}
+
+void jw_end(JsonWriter *w, char bracket)
+{
+	char ch = bracket == '{' ? '}' : ']';
+	jw_write(w, &ch, 1);
+	w->comma = true;
+	w->depth--;
+}
+
+void jw_string(JsonWriter *w, const char *name, const char *value)
+{
+	jw_name(w, name);
+	if (value == NULL)
+		jw_write(w, "null", 4);
+	else jw_escaped(w, value);
+}
+
+void jw_number(JsonWriter *w, const char *name, long value)
+{
+	char str[32];
+	int n = sprintf(str, "%ld", value);
+
+	jw_name(w, name);
+	jw_write(w, str, (apr_size_t)n);
+}
+
+void jw_bool(JsonWriter *w, const char *name, bool value)
+{
+	jw_name(w, name);
+	if (value)
+		jw_write(w, "true", 4);
+	else jw_write(w, "false", 5);
+}
+
+void jw_node(JsonWriter *w, const char *name, const JsonValue *node)
+{
+	char *json = node == NULL ? NULL : cJSON_PrintUnformatted(node);
+
+	jw_name(w, name);
+	if (json == NULL)
+		jw_write(w, "null", 4);
+	else jw_write(w, json, strlen(json));
+
+	cJSON_free(json);
+}
+
+apr_status_t jw_finish(JsonWriter *w)
+{
+	jw_flush(w);
+	return OK;
+}
+
+apr_status_t jw_fail(JsonWriter *w, HttpContext *c, const char *message)
+{
+	if (!w->sent)
+	{
+		w->used = 0;
+		return http_problem(c, NULL, message, 500);
+	}
+
+	APP_LOG(LOG_ERROR, "Response cut short: %s", message);
+
+	// as mod_proxy does for a broken backend: the chunked response
+	// gets no last chunk, and the connection is closed after it, for
+	// the client to see an incomplete response rather than a full one
+	request_rec *r = c->request;
+	apr_bucket_alloc_t *list = r->connection->bucket_alloc;
+	apr_bucket_brigade *bb = apr_brigade_create(r->pool, list);
+	APR_BRIGADE_INSERT_TAIL(bb, ap_bucket_error_create(HTTP_BAD_GATEWAY, NULL, r->pool, list));
+	APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(list));
+	ap_pass_brigade(r->output_filters, bb);
+
+	w->used = 0;
+	r->connection->keepalive = AP_CONN_CLOSE;
+	return OK;
+}
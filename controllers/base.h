@@ -4,6 +4,7 @@
 #include <http_context.h>
 #include <file_upload.h>
 #include "../includes/enums.h"
+#include "../includes/db_pool.h"
 
 void register_account_controller(void);
 void register_message_controller(void);
@@ -11,4 +12,48 @@ void register_room_controller(void);
 
 apr_status_t ensure_session_exists(HttpContext *c);
 
+#define ETAG_STORE 24
+
+/* Make a strong ETag out of everything the response depends on. */
+void make_etag(char etag[ETAG_STORE], char prefix, const char *data);
+
+/* Set the ETag of the response, then check if the client has it. */
+bool etag_matches(HttpContext *c, const char *etag);
+
+/* Enough for the rooms of most users, which then get an ETag, see get_rooms() */
+#define JW_BUFFER_SIZE 16384
+
+/* Writes JSON straight to the response, without building a tree,
+ * so that the memory used does not grow with the number of rows. */
+typedef struct JsonWriter
+{
+	request_rec *request;
+	bool sent;  // part of the response has gone out
+	bool comma; // the next value must be preceded by a comma
+	int depth;
+	apr_size_t used;
+	char buffer[JW_BUFFER_SIZE];
+} JsonWriter;
+
+void jw_init(JsonWriter *w, HttpContext *c);
+
+/* The name is NULL for the items of an array.
+ * The bracket is '{' for an object, else '[' for an array. */
+void jw_begin(JsonWriter *w, const char *name, char bracket);
+void jw_end(JsonWriter *w, char bracket);
+
+/* A NULL value is written as null. */
+void jw_string(JsonWriter *w, const char *name, const char *value);
+void jw_number(JsonWriter *w, const char *name, long value);
+void jw_bool(JsonWriter *w, const char *name, bool value);
+void jw_node(JsonWriter *w, const char *name, const JsonValue *node);
+
+/* Send what is left, and return the status of the request. */
+apr_status_t jw_finish(JsonWriter *w);
+
+/* Return the status of the request once writing has failed:
+ * a problem detail if nothing was sent yet, else the response
+ * is cut short and the connection closed for the client to know. */
+apr_status_t jw_fail(JsonWriter *w, HttpContext *c, const char *message);
+
 #endif
@@ -1,6 +1,26 @@
 #include <ctype.h>
+#include <unistd.h>
+#include <apr_atomic.h>
+#include <apr_file_io.h>
+#include <apr_mmap.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
 #include "base.h"
+#include "../includes/ai_queue.h"
 #include "../includes/message.h"
+#include "../includes/room_notify.h"
+#include "../includes/senders.h"
+#include "../includes/voice_cache.h"
+
+/* Maximum seconds a client can wait for new messages */
+#define MAX_WAIT 30
+
+/* Maximum seconds to wait for the voice being made by another request */
+#define VOICE_WAIT 60
+
+/* Messages given at once, unless the client asks for fewer */
+#define PAGE_SIZE 100
+#define MAX_PAGE_SIZE 500
 
 typedef struct UrlArgs
 {
@@ -8,7 +28,11 @@ typedef struct UrlArgs
 	int roomId;
 	int groupId;
 	int joinKey;
+	int wait;
+	int limit;
+	char *version;
 	char *lastMessageDateSent;
+	char *beforeDateSent;
 } UrlArgs;
 
 static UrlArgs get_url_args(HttpContext *c)
@@ -26,8 +50,19 @@ static UrlArgs get_url_args(HttpContext *c)
 		KVP_TO_INT(x, args.joinKey, "k")
 		KVP_TO_INT(x, args.groupId, "groupId")
 		KVP_TO_INT(x, args.joinKey, "joinKey")
+		KVP_TO_INT(x, args.wait, "wait")
+		KVP_TO_INT(x, args.limit, "limit")
+		KVP_TO_STR(x, args.version, "v")
 		KVP_TO_STR(x, args.lastMessageDateSent, "lastMessageDateSent")
+		KVP_TO_STR(x, args.lastMessageDateSent, "after")
+		KVP_TO_STR(x, args.beforeDateSent, "before")
 	}
+
+	if (args.limit <= 0)
+		args.limit = PAGE_SIZE;
+	else if (args.limit > MAX_PAGE_SIZE)
+		args.limit = MAX_PAGE_SIZE;
+
 	return args;
 }
 
@@ -43,6 +78,7 @@ typedef struct RoomInfo
 	char groupName[128];
 	char *groupAbout;
 	char groupBanner[FILE_PATH_STORE];
+	char latestMessageId[GUID_STORE];
 	char skippedMessageId[GUID_STORE];
 
 	bool get_extra_info;
@@ -65,6 +101,7 @@ static errno_t room_info_callback(void *context, int argc, char **argv, char **c
 		KVP_TO_STR_COPY(x, room->roomName, sizeof(room->roomName), "roomName")
 		KVP_TO_STR_COPY(x, room->groupName, sizeof(room->groupName), "groupName")
 		KVP_TO_STR_COPY(x, room->groupBanner, sizeof(room->groupBanner), "groupBanner")
+		KVP_TO_STR_COPY(x, room->latestMessageId, sizeof(room->latestMessageId), "latestMessageId")
 		KVP_TO_STR_COPY(x, room->skippedMessageId, sizeof(room->skippedMessageId), "skippedMessageId")
 
 		if (room->get_extra_info)
@@ -73,7 +110,94 @@ static errno_t room_info_callback(void *context, int argc, char **argv, char **c
 	return 0;
 }
 
-static apr_status_t get_room_info(HttpContext *c, RoomInfo *room, UrlArgs args, char *buffer, bool get_extra_info)
+/* Room info kept per server process, as looked up by the user */
+#define ROOM_CACHE_SIZE 1024
+
+/* Catches what is not notified, such as a change made straight in the database */
+#define ROOM_CACHE_SECONDS 60
+
+typedef struct CachedRoom
+{
+	int userId;
+	int roomId; // as given, 0 if by group
+	int groupId;
+	unsigned infoVersion;
+	apr_time_t expires;
+	RoomInfo room;
+} CachedRoom;
+
+static struct
+{
+	apr_thread_mutex_t *mutex;
+	CachedRoom *entries;
+} room_cache;
+
+static void init_room_cache(void)
+{
+	apr_pool_t *pool = NULL;
+	apr_thread_mutex_t *mutex = NULL;
+
+	if (apr_pool_create(&pool, NULL) != APR_SUCCESS ||
+		apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to initialise the room cache");
+		return;
+	}
+
+	room_cache.entries = apr_pcalloc(pool, ROOM_CACHE_SIZE * sizeof(CachedRoom));
+	room_cache.mutex = mutex; // must come last
+}
+
+static CachedRoom *room_cache_slot(UrlArgs args)
+{
+	unsigned hash = (unsigned)args.userId * 2654435761u;
+	hash ^= (unsigned)args.roomId * 40503u;
+	hash ^= (unsigned)args.groupId * 97u;
+	return &room_cache.entries[hash % ROOM_CACHE_SIZE];
+}
+
+static bool get_cached_room(UrlArgs args, RoomInfo *room)
+{
+	if (room_cache.mutex == NULL)
+		return false;
+
+	bool found = false;
+	apr_thread_mutex_lock(room_cache.mutex);
+
+	CachedRoom *entry = room_cache_slot(args);
+	if (entry->room.id != 0 &&
+		entry->userId == args.userId &&
+		entry->roomId == args.roomId &&
+		entry->groupId == args.groupId &&
+		entry->expires > apr_time_now())
+	{
+		*room = entry->room;
+		unsigned version;
+		found = get_room_info_version(room->id, &version) && version == entry->infoVersion;
+	}
+	apr_thread_mutex_unlock(room_cache.mutex);
+	return found;
+}
+
+static void put_cached_room(UrlArgs args, const RoomInfo *room, unsigned infoVersion)
+{
+	if (room_cache.mutex == NULL)
+		return;
+
+	apr_thread_mutex_lock(room_cache.mutex);
+
+	CachedRoom *entry = room_cache_slot(args);
+	entry->userId = args.userId;
+	entry->roomId = args.roomId;
+	entry->groupId = args.groupId;
+	entry->infoVersion = infoVersion;
+	entry->expires = apr_time_now() + apr_time_from_sec(ROOM_CACHE_SECONDS);
+	entry->room = *room;
+
+	apr_thread_mutex_unlock(room_cache.mutex);
+}
+
+static errno_t query_room_info(HttpContext *c, RoomInfo *room, UrlArgs args, bool get_extra_info)
 {
 	DbQuery query = {.dbc = &c->dbc};
 	query.callback = room_info_callback;
@@ -90,10 +214,33 @@ static apr_status_t get_room_info(HttpContext *c, RoomInfo *room, UrlArgs args,
 	argv[query.argc++] = json_new_int(args.roomId, false);
 	argv[query.argc++] = json_new_int(args.groupId, false);
 
+	// read before the query, so that a change made meanwhile is not missed
+	unsigned infoVersion = 0;
+	bool tracked = args.roomId != 0 && get_room_info_version(args.roomId, &infoVersion);
+
 	memset(room, 0, sizeof(*room)); // first clear
 	room->get_extra_info = get_extra_info;
 
-	if (sql_exec(&query, argv) != 0)
+	errno_t e = sql_exec(&query, argv);
+	if (e != 0)
+		return e;
+
+	// only if the room can be tracked, to learn of its changes
+	if (room->id != 0 && !get_extra_info)
+	{
+		if (!tracked) // when given only the group
+			tracked = get_room_info_version(room->id, &infoVersion);
+		if (tracked)
+			put_cached_room(args, room, infoVersion);
+	}
+	return 0;
+}
+
+static apr_status_t get_room_info(HttpContext *c, RoomInfo *room, UrlArgs args, char *buffer, bool get_extra_info)
+{
+	// the extra info is not cached, being needed only by the chat page
+	if ((get_extra_info || !get_cached_room(args, room)) &&
+		query_room_info(c, room, args, get_extra_info) != 0)
 	{
 		strcpy(buffer, tl("Internal error: failed to get data"));
 		return HTTP_INTERNAL_SERVER_ERROR;
@@ -130,40 +277,289 @@ struct messages_callback
 {
 	int signedInUserId;
 	JsonArray *messages;
+	JsonWriter *writer;
+
+	int count;
+	char oldest[DATE_STORE]; // in local time
+	char newest[DATE_STORE];
+
+	// the distinct senders of the page, as met,
+	// given to the rows by their index here
+	int senderCount;
+	row_id_t senderIds[MAX_PAGE_SIZE];
 };
 
+/* Straight from Messages, the senders being resolved
+ * afterwards for the whole page, mostly from the cache */
+#define MESSAGE_COLUMNS "HEX(Id), HEX(ParentId), SenderId, DateSent, Status, " \
+	"IF(DateDeleted IS NULL, Content, NULL)"
+
+/* the messages sent after the cursor */
 static const char *messages_sql =
-	"SELECT Id, ParentId, UserId, UserName, DateSent, Status, Content\n"
-	"FROM ViewMessages\n"
-	"WHERE RoomId = ? and DateSent > ?\n"
-	"ORDER by RoomId, DateSent\n";
+	"SELECT " MESSAGE_COLUMNS "\n"
+	"FROM Messages\n"
+	"WHERE RoomId = ? and DateSent > ? and Type != 2\n"
+	"ORDER by RoomId, DateSent\n"
+	"LIMIT ?\n";
+
+/* the latest messages sent before the cursor,
+ * read backwards on the index then put in order */
+static const char *messages_before_sql =
+	"SELECT * FROM (\n"
+	"\tSELECT " MESSAGE_COLUMNS "\n"
+	"\tFROM Messages\n"
+	"\tWHERE RoomId = ? and DateSent < ? and Type != 2\n"
+	"\tORDER by RoomId desc, DateSent desc\n"
+	"\tLIMIT ?) as m\n"
+	"ORDER by DateSent\n";
+
+/* the latest messages of the room */
+static const char *messages_latest_sql =
+	"SELECT * FROM (\n"
+	"\tSELECT " MESSAGE_COLUMNS "\n"
+	"\tFROM Messages\n"
+	"\tWHERE RoomId = ? and Type != 2\n"
+	"\tORDER by RoomId desc, DateSent desc\n"
+	"\tLIMIT ?) as m\n"
+	"ORDER by DateSent\n";
+
+typedef struct MessageRow
+{
+	int sender; // index in the page
+	char dateSent[64];
+	const char *id;
+	const char *parentId;
+	int status;
+	const char *content;
+} MessageRow;
+
+/* Read the row, and keep the cursors and senders of the page */
+static void read_message_row(MessageRow *m, char **argv, struct messages_callback *info)
+{
+	if (info->count++ == 0)
+		str_copy(info->oldest, sizeof(info->oldest), argv[3]);
+	str_copy(info->newest, sizeof(info->newest), argv[3]);
+
+	row_id_t senderId = atoll(argv[2]);
+	int i = 0;
+	while (i < info->senderCount && info->senderIds[i] != senderId)
+		i++;
+
+	if (i == info->senderCount && i < MAX_PAGE_SIZE)
+		info->senderIds[info->senderCount++] = senderId;
+	m->sender = i;
+
+	local_to_utc(m->dateSent, sizeof(m->dateSent), argv[3]);
+
+	m->id = argv[0];
+	m->parentId = argv[1];
+	m->status = atoi(argv[4]);
+	m->content = argv[5];
+}
+
+/* Get the senders of the page, to be freed by the caller */
+static Sender *get_page_senders(DbContext *dbc, const struct messages_callback *page, errno_t *e)
+{
+	Sender *senders = calloc((size_t)page->senderCount + 1, sizeof(Sender));
+	if (senders == NULL)
+	{
+		*e = ENOMEM;
+		return NULL;
+	}
+
+	for (int i = 0; i < page->senderCount; i++)
+		senders[i].sessionId = page->senderIds[i];
+
+	*e = get_senders(dbc, senders, page->senderCount);
+	if (*e != 0)
+	{
+		free(senders);
+		return NULL;
+	}
+
+	// such as of a removed user, which the rows still refer to
+	for (int i = 0; i < page->senderCount; i++)
+	{
+		if (senders[i].userId == 0)
+			str_copy(senders[i].name, sizeof(senders[i].name), tl("Unknown sender"));
+	}
+	return senders;
+}
+
+/* The "senders" that the "sender" of the messages is an index in,
+ * the same for the pages and the stream events */
+static void write_sender(JsonWriter *w, const Sender *sender, int signedInUserId)
+{
+	jw_begin(w, NULL, '{');
+	if (sender->userId != 0 && sender->userId == signedInUserId)
+		jw_bool(w, "sentByMe", true);
+	jw_string(w, "senderName", sender->name);
+	jw_end(w, '{');
+}
+
+static JsonObject *new_sender(const Sender *sender, int signedInUserId)
+{
+	JsonObject *item = json_new_object();
+	if (sender->userId != 0 && sender->userId == signedInUserId)
+		json_put_node(item, "sentByMe", cJSON_CreateBool(true), 0);
+	json_put_string(item, "senderName", sender->name, 0);
+	return item;
+}
 
 static errno_t messages_callback(void *context, int argc, char **argv, char **columns)
 {
-	CHECK_SQL_CALLBACK(7);
+	CHECK_SQL_CALLBACK(6);
 	struct messages_callback *info = (struct messages_callback *)context;
 	JsonObject *msg = json_new_object();
-	char str[64];
 
-	int userId = atoi(argv[2]);
-	if (userId == info->signedInUserId)
-		json_put_node(msg, "sentByMe", cJSON_CreateBool(true), 0);
+	MessageRow m;
+	read_message_row(&m, argv, info);
+
+	json_put_number(msg, "sender", m.sender, 0); // see new_sender()
+	json_put_string(msg, "dateSent", m.dateSent, 0);
+	json_put_string(msg, "id", m.id, 0);
+	json_put_string(msg, "parentId", m.parentId, 0);
+	json_put_number(msg, "status", m.status, 0);
+	json_put_string(msg, "content", m.content, 0);
+
+	json_array_add(info->messages, msg);
+	return 0;
+}
+
+/* Same as above, but written straight to the response.
+ * The senders are written after, once for the whole page. */
+static errno_t write_messages_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(6);
+	struct messages_callback *info = (struct messages_callback *)context;
+	JsonWriter *w = info->writer;
+
+	if (w->request->connection->aborted)
+		return ECONNABORTED; // no need to read the rest
+
+	MessageRow m;
+	read_message_row(&m, argv, info);
+
+	jw_begin(w, NULL, '{');
+	jw_number(w, "sender", m.sender);
+	jw_string(w, "dateSent", m.dateSent);
+	jw_string(w, "id", m.id);
+	jw_string(w, "parentId", m.parentId);
+	jw_number(w, "status", m.status);
+	jw_string(w, "content", m.content);
+	jw_end(w, '{');
+	return 0;
+}
+
+static JsonObject *new_room_info(const RoomInfo *room, const char *version)
+{
+	JsonObject *info = json_new_object();
+	json_put_number(info, "id", room->id, 0);
+	json_put_string(info, "skippedMessageId", room->skippedMessageId, 0);
+	json_put_string(info, "version", version, 0);
+
+	char name[256];
+	if (str_empty(room->roomName))
+		strcpy(name, room->groupName);
+	else sprintf(name, "%s: %s", room->groupName, room->roomName);
+	json_put_string(info, "name", name, 0);
+
+	if (room->memberId != 0)
+		json_put_node(info, "joined", cJSON_CreateBool(true), 0);
+
+	return info;
+}
+
+static errno_t has_more_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(1);
+	*(bool *)context = atoi(argv[0]) != 0;
+	return 0;
+}
+
+/* Check if there are messages past a full page, given how it was asked for */
+static errno_t has_more_messages(HttpContext *c, int roomId, const struct messages_callback *page, int limit, bool older, bool *hasMore)
+{
+	*hasMore = false;
+	if (page->count < limit)
+		return 0;
+
+	DbQuery query = {.dbc = &c->dbc};
+	query.callback = has_more_callback;
+	query.callback_context = hasMore;
+
+	if (older)
+		query.sql = "SELECT EXISTS(SELECT 1 FROM Messages WHERE RoomId = ? and DateSent < ? and Type != 2)";
+	else query.sql = "SELECT EXISTS(SELECT 1 FROM Messages WHERE RoomId = ? and DateSent > ? and Type != 2)";
 
-	if (!str_empty(argv[3]))
-		snprintf(str, sizeof(str), "%s", argv[3]);
+	JsonValue argv[2];
+	argv[query.argc++] = json_new_int(roomId, false);
+	argv[query.argc++] = json_new_str(older ? page->oldest : page->newest, false);
+
+	return sql_exec(&query, argv);
+}
+
+/* Pick the query of the page: the latest messages, or those
+ * before the cursor, else those after the cursor (the default). */
+static void set_messages_query(DbQuery *query, JsonValue *argv, int roomId, const char *after, const char *before, int limit)
+{
+	argv[query->argc++] = json_new_int(roomId, false);
+
+	if (!str_empty(before))
+	{
+		query->sql = messages_before_sql;
+		argv[query->argc++] = json_new_str(before, false);
+	}
+	else if (str_empty(after))
+		query->sql = messages_latest_sql;
 	else
-		snprintf(str, sizeof(str), "ANO-%s", argv[2]);
-	json_put_string(msg, "senderName", str, 0);
+	{
+		query->sql = messages_sql;
+		argv[query->argc++] = json_new_str(after, false);
+	}
+
+	argv[query->argc++] = json_new_int(limit, false);
+}
 
-	local_to_utc(str, sizeof(str), argv[4]);
-	json_put_string(msg, "dateSent", str, 0);
+/* Get the room info, and the room messages sent after dateSent,
+ * else the latest messages if dateSent is empty.
+ * The room version must be taken before calling this function. */
+static errno_t load_messages(HttpContext *c, const RoomInfo *room, int userId, const char *dateSent, const char *version, JsonObject **roomInfo, JsonArray **messages, JsonArray **senders, bool *hasMore)
+{
+	struct messages_callback context = {
+		.signedInUserId = userId,
+		.messages = json_new_array()
+	};
 
-	json_put_string(msg, "id", argv[0], 0);
-	json_put_string(msg, "parentId", argv[1], 0);
-	json_put_number(msg, "status", atoi(argv[5]), 0);
-	json_put_string(msg, "content", argv[6], 0);
+	DbQuery query = {.dbc = &c->dbc};
+	query.callback = messages_callback;
+	query.callback_context = &context;
 
-	json_array_add(info->messages, msg);
+	JsonValue argv[3];
+	set_messages_query(&query, argv, room->id, dateSent, NULL, PAGE_SIZE);
+
+	Sender *page = NULL;
+	errno_t e = sql_exec(&query, argv);
+
+	if (e == 0)
+		e = has_more_messages(c, room->id, &context, PAGE_SIZE, str_empty(dateSent), hasMore);
+
+	if (e == 0)
+		page = get_page_senders(&c->dbc, &context, &e);
+
+	if (e != 0)
+	{
+		cJSON_Delete(context.messages);
+		return e;
+	}
+
+	*senders = json_new_array();
+	for (int i = 0; i < context.senderCount; i++)
+		json_array_add(*senders, new_sender(&page[i], userId));
+
+	*roomInfo = new_room_info(room, version);
+	*messages = context.messages;
+	free(page);
 	return 0;
 }
 
@@ -175,112 +571,753 @@ static apr_status_t get_messages(HttpContext *c)
 	if (utc_to_local(dateSent, sizeof(dateSent), args.lastMessageDateSent) != 0)
 		return HTTP_BAD_REQUEST; // invalid date format
 
+	char beforeDateSent[DATE_STORE];
+	if (utc_to_local(beforeDateSent, sizeof(beforeDateSent), args.beforeDateSent) != 0)
+		return HTTP_BAD_REQUEST;
+
+	// the latest page also goes back in time
+	bool older = !str_empty(beforeDateSent) || str_empty(dateSent);
+
 	char buffer[1024];
 	RoomInfo room;
 
+	// before waiting, so that only the members learn of the changes
 	apr_status_t status = get_room_info(c, &room, args, buffer, false);
 	if (status != OK)
 		return http_problem(c, NULL, buffer, status);
 
+	// if given the version the client has, then first
+	// wait for a change, and skip the database if none
+	if (args.roomId != 0 && !str_empty(args.version) && str_empty(beforeDateSent))
+	{
+		int wait = args.wait < 0 ? 0 : args.wait < MAX_WAIT ? args.wait : MAX_WAIT;
+
+		// not to keep a connection of the pool while waiting
+		db_pool_release(&c->dbc, true);
+		bool changed = wait_room_change(room.id, args.version, wait);
+		db_pool_acquire(&c->dbc);
+
+		if (!changed)
+			return HTTP_NO_CONTENT;
+
+		// the room info may have changed meanwhile, mostly from the cache
+		status = get_room_info(c, &room, args, buffer, false);
+		if (status != OK)
+			return http_problem(c, NULL, buffer, status);
+	}
+
+	char version[ROOM_VERSION_STORE];
+	get_room_version(room.id, version);
+
+	// the response depends on all of these
+	char etag[ETAG_STORE];
+	snprintf(buffer, sizeof(buffer), "%d|%d|%s|%s|%d|%s|%d|%s|%s|%d",
+		args.userId, room.id, dateSent, room.latestMessageId, room.state,
+		room.skippedMessageId, room.memberId != 0, version, beforeDateSent, args.limit);
+	make_etag(etag, 'm', buffer);
+
+	if (etag_matches(c, etag))
+		return HTTP_NOT_MODIFIED;
+
+	JsonWriter w[1];
+	jw_init(w, c);
+
+	JsonObject *info = new_room_info(&room, version);
+	jw_begin(w, NULL, '{');
+	jw_node(w, "roomInfo", info);
+	jw_begin(w, "messages", '[');
+	cJSON_Delete(info);
+
+	// the rows are written as they are read
 	struct messages_callback context = {
 		.signedInUserId = args.userId,
-		.messages = json_new_array()
+		.writer = w
 	};
 
 	DbQuery query = {.dbc = &c->dbc};
-	query.sql = messages_sql;
-	query.callback = messages_callback;
+	query.callback = write_messages_callback;
 	query.callback_context = &context;
 
-	JsonValue argv[2];
-	argv[query.argc++] = json_new_int(room.id, false);
-	argv[query.argc++] = json_new_str(dateSent, false);
+	JsonValue argv[3];
+	set_messages_query(&query, argv, room.id, dateSent, beforeDateSent, args.limit);
+
+	// past the page, in the direction of the cursor
+	bool hasMore = false;
+
+	errno_t e = sql_exec(&query, argv);
+
+	if (e == 0)
+		e = has_more_messages(c, room.id, &context, args.limit, older, &hasMore);
+
+	Sender *senders = NULL;
+	if (e == 0)
+		senders = get_page_senders(&c->dbc, &context, &e);
+
+	if (e != 0)
+		return jw_fail(w, c, tl("An error has occurred while obtaining the messages"));
+
+	jw_end(w, '[');
+	jw_bool(w, "hasMore", hasMore);
+
+	// for the rows to refer to, by index
+	jw_begin(w, "senders", '[');
+	for (int i = 0; i < context.senderCount; i++)
+		write_sender(w, &senders[i], args.userId);
+	jw_end(w, '[');
+	free(senders);
+
+	jw_end(w, '{');
+	return jw_finish(w);
+}
+
+/* Events kept per room feed, for the subscribers to catch up */
+#define FEED_EVENTS 32
+
+/* Rooms that one server process can stream at the same time */
+#define MAX_FEEDS 128
+
+/* A stream then ends, and the client reconnects */
+#define STREAM_SECONDS (10 * 60)
+
+#define KEEPALIVE_SECONDS 15
+
+typedef struct FeedEvent
+{
+	const char *name;
+	char *data; // JSON
+	int userId; // sender of a message
+	char id[DATE_STORE]; // for the client to resume from
+} FeedEvent;
+
+/* Changes of a room, obtained once for all the subscribers of this process */
+typedef struct RoomFeed
+{
+	int roomId;
+	int subscribers;
+	apr_thread_mutex_t *lock; // held while refreshing
+	char version[ROOM_VERSION_STORE]; // as of the last refresh
+	char lastDateSent[DATE_STORE]; // of the latest message, in local time
+	bool cursorHeld; // by a message still being written
+	char lastCheck[DATE_STORE]; // database time of the last refresh
+	int state;
+	char skippedMessageId[GUID_STORE];
+	unsigned nextSeq;
+	FeedEvent events[FEED_EVENTS]; // ring buffer
+} RoomFeed;
+
+static struct
+{
+	apr_thread_mutex_t *mutex;
+	RoomFeed *feeds;
+} feeds;
+
+static void init_room_feeds(void)
+{
+	apr_pool_t *pool = NULL;
+	apr_thread_mutex_t *mutex = NULL;
+
+	if (apr_pool_create(&pool, NULL) != APR_SUCCESS ||
+		apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to initialise the room feeds");
+		return;
+	}
+
+	feeds.feeds = apr_pcalloc(pool, MAX_FEEDS * sizeof(RoomFeed));
+	for (int i = 0; i < MAX_FEEDS; i++)
+	{
+		if (apr_thread_mutex_create(&feeds.feeds[i].lock, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS)
+			return;
+	}
+	feeds.mutex = mutex; // must come last
+}
+
+static RoomFeed *subscribe_feed(int roomId)
+{
+	RoomFeed *feed = NULL, *unused = NULL;
+	if (feeds.mutex == NULL)
+		return NULL;
+
+	apr_thread_mutex_lock(feeds.mutex);
+	for (int i = 0; i < MAX_FEEDS; i++)
+	{
+		RoomFeed *f = &feeds.feeds[i];
+		if (f->subscribers == 0)
+		{
+			if (unused == NULL)
+				unused = f;
+		}
+		else if (f->roomId == roomId)
+		{
+			feed = f;
+			break;
+		}
+	}
+
+	if (feed == NULL && unused != NULL)
+	{
+		feed = unused;
+		for (int i = 0; i < FEED_EVENTS; i++)
+		{
+			free(feed->events[i].data);
+			feed->events[i].data = NULL;
+		}
+		feed->roomId = roomId;
+		feed->version[0] = '\0'; // not yet refreshed
+		feed->nextSeq = 0;
+	}
+
+	if (feed != NULL)
+		feed->subscribers++;
+	apr_thread_mutex_unlock(feeds.mutex);
+	return feed;
+}
+
+static void unsubscribe_feed(RoomFeed *feed)
+{
+	apr_thread_mutex_lock(feeds.mutex);
+	feed->subscribers--;
+	apr_thread_mutex_unlock(feeds.mutex);
+}
+
+static void feed_add(RoomFeed *feed, const char *name, JsonObject *data, int userId, const char *id)
+{
+	char *json = cJSON_PrintUnformatted(data);
+	if (json == NULL)
+		return;
+
+	FeedEvent *event = &feed->events[feed->nextSeq % FEED_EVENTS];
+	size_t size = strlen(json) + 1;
+
+	free(event->data);
+	event->data = malloc(size); // lives beyond the request
+	if (event->data != NULL)
+		memcpy(event->data, json, size);
+	cJSON_free(json);
+
+	event->name = name;
+	event->userId = userId;
+	str_copy(event->id, sizeof(event->id), id);
+	feed->nextSeq++;
+}
+
+struct feed_messages
+{
+	RoomFeed *feed;
+	struct messages_callback page;
+};
+
+static errno_t feed_messages_callback(void *context, int argc, char **argv, char **columns)
+{
+	struct feed_messages *info = (struct feed_messages *)context;
+	RoomFeed *feed = info->feed;
+
+	errno_t e = messages_callback(&info->page, argc, argv, columns);
+	if (e == 0)
+	{
+		// a message still being written is sent again until finished
+		if (atoi(argv[4]) == MessageStatus_Writing)
+			feed->cursorHeld = true;
+
+		if (!feed->cursorHeld && strcmp(argv[3], feed->lastDateSent) > 0)
+			str_copy(feed->lastDateSent, DATE_STORE, argv[3]);
+	}
+	return e;
+}
+
+/* The start of a message event, for take_events() to add sentByMe */
+#define MESSAGE_EVENT_START "{\"senders\":[{"
+
+/* Add the messages of the page as events, once their senders are known.
+ * Each is as a page of one message, with its sender first. */
+static errno_t feed_add_messages(DbContext *dbc, RoomFeed *feed, struct messages_callback *page)
+{
+	errno_t e = 0;
+	Sender *senders = get_page_senders(dbc, page, &e);
+	if (senders == NULL)
+		return e;
+
+	JsonObject *msg;
+	while ((msg = cJSON_DetachItemFromArray(page->messages, 0)) != NULL)
+	{
+		const Sender *sender = &senders[(int)json_get_number(msg, "sender")];
+		cJSON_DeleteItemFromObject(msg, "sender");
+		json_put_number(msg, "sender", 0, 0);
+
+		JsonObject *data = json_new_object();
+		JsonArray *one = json_new_array();
+		json_array_add(one, new_sender(sender, 0)); // sentByMe is added per subscriber
+		json_put_node(data, "senders", one, 0);
+		JsonArray *messages = json_new_array();
+		json_array_add(messages, msg);
+		json_put_node(data, "messages", messages, 0);
+
+		feed_add(feed, "message", data, (int)sender->userId, json_get_string(msg, "dateSent"));
+		cJSON_Delete(data);
+	}
+	free(senders);
+	return 0;
+}
+
+static errno_t feed_deleted_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(1);
+	JsonObject *data = json_new_object();
+	json_put_string(data, "id", argv[0], 0);
+	feed_add((RoomFeed *)context, "delete", data, 0, "");
+	cJSON_Delete(data);
+	return 0;
+}
+
+struct feed_status
+{
+	int state;
+	char skippedMessageId[GUID_STORE];
+	char now[DATE_STORE];
+	char latest[DATE_STORE];
+};
+
+static errno_t feed_status_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(4);
+	struct feed_status *status = (struct feed_status *)context;
+	status->state = atoi(argv[0]);
+	str_copy(status->skippedMessageId, GUID_STORE, argv[1]);
+	str_copy(status->now, DATE_STORE, argv[2]);
+	str_copy(status->latest, DATE_STORE, str_empty(argv[3]) ? "1970-01-01 00:00:00" : argv[3]);
+	return 0;
+}
+
+/* Get the room changes, unless already done for the current version */
+static errno_t refresh_feed(HttpContext *c, RoomFeed *feed, char version[ROOM_VERSION_STORE])
+{
+	errno_t e = 0;
+	apr_thread_mutex_lock(feed->lock);
+
+	// must be taken before getting the changes
+	get_room_version(feed->roomId, version);
+	if (str_equal(version, feed->version))
+		goto finish;
+
+	struct feed_status status = {0};
+	DbQuery query = {.dbc = &c->dbc};
+	query.callback = feed_status_callback;
+	query.callback_context = &status;
+	query.sql =
+		"select State, HEX(SkippedMessageId), CURRENT_TIMESTAMP(6),\n"
+		"(select max(DateSent) from Messages where RoomId = r.Id and DateSent < coalesce(\n"
+		"\t(select min(DateSent) from Messages where RoomId = r.Id and Status = 2), '9999-12-31'))\n"
+		"from Rooms as r where Id = ?\n";
+
+	JsonValue argv[3];
+	argv[query.argc++] = json_new_int(feed->roomId, false);
+
+	e = sql_exec(&query, argv);
+	if (e != 0)
+		goto finish;
+
+	if (str_empty(feed->version)) // if first time
+	{
+		str_copy(feed->lastDateSent, DATE_STORE, status.latest);
+		str_copy(feed->lastCheck, DATE_STORE, status.now);
+		str_copy(feed->skippedMessageId, GUID_STORE, status.skippedMessageId);
+		feed->state = status.state;
+		str_copy(feed->version, ROOM_VERSION_STORE, version);
+		goto finish;
+	}
+
+	struct feed_messages messages = {feed, {.messages = json_new_array()}};
+	char lastDateSent[DATE_STORE];
+	str_copy(lastDateSent, DATE_STORE, feed->lastDateSent);
+
+	feed->cursorHeld = false;
+	query.callback = feed_messages_callback;
+	query.callback_context = &messages;
+	query.sql = messages_sql;
+	argv[query.argc++] = json_new_str(lastDateSent, false);
+	argv[query.argc++] = json_new_int(MAX_PAGE_SIZE, false);
+
+	e = sql_exec(&query, argv);
+	if (e == 0)
+		e = feed_add_messages(&c->dbc, feed, &messages.page);
+
+	cJSON_Delete(messages.page.messages);
+	if (e != 0)
+	{
+		// to get them again on the next refresh
+		str_copy(feed->lastDateSent, DATE_STORE, lastDateSent);
+		goto finish;
+	}
+
+	query.callback = feed_deleted_callback;
+	query.sql = "select HEX(Id) from Messages where RoomId = ? and DateDeleted > ?";
+	query.argc = 1; // keep the roomId
+	argv[query.argc++] = json_new_str(feed->lastCheck, false);
+
+	e = sql_exec(&query, argv);
+	if (e != 0)
+		goto finish;
+
+	str_copy(feed->lastCheck, DATE_STORE, status.now);
+
+	if (feed->state != status.state || !str_equal(feed->skippedMessageId, status.skippedMessageId))
+	{
+		feed->state = status.state;
+		str_copy(feed->skippedMessageId, GUID_STORE, status.skippedMessageId);
+
+		JsonObject *data = json_new_object();
+		json_put_number(data, "state", feed->state, 0);
+		json_put_string(data, "skippedMessageId", feed->skippedMessageId, 0);
+		feed_add(feed, "room", data, 0, "");
+		cJSON_Delete(data);
+	}
+
+	str_copy(feed->version, ROOM_VERSION_STORE, version);
+
+finish:
+	str_copy(version, ROOM_VERSION_STORE, feed->version);
+	apr_thread_mutex_unlock(feed->lock);
+	return e;
+}
+
+/* Get the events after the cursor, as SSE text to be freed.
+ * Return NULL if the subscriber fell too far behind. */
+static char *take_events(RoomFeed *feed, unsigned *cursor, int userId)
+{
+	str_lit_t tracker = "stream_events";
+	char *text = NULL;
+	apr_thread_mutex_lock(feed->lock);
+
+	if (feed->nextSeq - *cursor > FEED_EVENTS)
+		goto finish;
+
+	size_t size = 1;
+	for (unsigned seq = *cursor; seq != feed->nextSeq; seq++)
+	{
+		const FeedEvent *event = &feed->events[seq % FEED_EVENTS];
+		if (event->data != NULL)
+			size += strlen(event->data) + strlen(event->id) + 64;
+	}
+
+	text = _malloc(size, tracker);
+	if (text == NULL)
+		goto finish;
+
+	char *end = text;
+	*end = '\0';
+	for (; *cursor != feed->nextSeq; (*cursor)++)
+	{
+		const FeedEvent *event = &feed->events[*cursor % FEED_EVENTS];
+		if (event->data == NULL)
+			continue;
+
+		if (!str_empty(event->id))
+			end += sprintf(end, "id: %s\n", event->id);
+
+		if (event->userId != 0 && event->userId == userId &&
+			strncmp(event->data, MESSAGE_EVENT_START, strlen(MESSAGE_EVENT_START)) == 0)
+			end += sprintf(end, "event: %s\ndata: " MESSAGE_EVENT_START "\"sentByMe\":true,%s\n\n",
+				event->name, event->data + strlen(MESSAGE_EVENT_START));
+		else
+			end += sprintf(end, "event: %s\ndata: %s\n\n", event->name, event->data);
+	}
+
+finish:
+	apr_thread_mutex_unlock(feed->lock);
+	return text;
+}
+
+static apr_status_t stream_messages(HttpContext *c)
+{
+	request_rec *r = c->request;
+	UrlArgs args = get_url_args(c);
+
+	// when the client reconnects by itself
+	const char *lastEventId = apr_table_get(r->headers_in, "Last-Event-ID");
+	if (!str_empty(lastEventId))
+		args.lastMessageDateSent = (char *)lastEventId;
+
+	char dateSent[DATE_STORE];
+	if (utc_to_local(dateSent, sizeof(dateSent), args.lastMessageDateSent) != 0)
+		return HTTP_BAD_REQUEST; // invalid date format
+
+	char buffer[1024];
+	RoomInfo room;
+
+	apr_status_t status = get_room_info(c, &room, args, buffer, false);
+	if (status != OK)
+		return http_problem(c, NULL, buffer, status);
+
+	char version[ROOM_VERSION_STORE];
+	RoomFeed *feed = subscribe_feed(room.id);
+
+	if (feed == NULL || refresh_feed(c, feed, version) != 0 || str_empty(version))
+	{
+		if (feed != NULL)
+			unsubscribe_feed(feed);
+		return http_problem(c, NULL, tl("Streaming is not available, please retry later"), HTTP_SERVICE_UNAVAILABLE);
+	}
+
+	apr_thread_mutex_lock(feed->lock);
+	unsigned cursor = feed->nextSeq;
+	apr_thread_mutex_unlock(feed->lock);
+
+	// first send what the client does not have
+	JsonObject *content = json_new_object();
+	JsonObject *info = NULL;
+	JsonArray *messages = NULL;
+	JsonArray *senders = NULL;
+
+	char snapshot[ROOM_VERSION_STORE];
+	get_room_version(room.id, snapshot);
+
+	bool hasMore = false;
+	if (load_messages(c, &room, args.userId, dateSent, snapshot, &info, &messages, &senders, &hasMore) != 0)
+	{
+		cJSON_Delete(content);
+		unsubscribe_feed(feed);
+		return http_problem(c, NULL, tl("An error has occurred while obtaining the messages"), 500);
+	}
+	// for the client to resume from the latest message
+	const char *id = args.lastMessageDateSent;
+	for (JsonObject *msg = messages->child; msg != NULL; msg = msg->next)
+		id = json_get_string(msg, "dateSent");
+	str_copy(buffer, sizeof(buffer), id == NULL ? "" : id);
+
+	json_put_node(content, "roomInfo", info, 0);
+	json_put_node(content, "messages", messages, 0);
+	json_put_node(content, "senders", senders, 0);
+	json_put_node(content, "hasMore", cJSON_CreateBool(hasMore), 0);
+
+	char *json = cJSON_PrintUnformatted(content);
+	cJSON_Delete(content);
+
+	ap_set_content_type(r, "text/event-stream");
+	apr_table_setn(r->headers_out, "Cache-Control", "no-cache");
+	apr_table_setn(r->headers_out, "X-Accel-Buffering", "no");
+	apr_table_setn(r->subprocess_env, "no-gzip", "1");
+
+	if (!str_empty(buffer))
+		ap_rprintf(r, "id: %s\n", buffer);
+	ap_rprintf(r, "event: messages\ndata: %s\n\n", json == NULL ? "{}" : json);
+	cJSON_free(json);
+
+	apr_time_t end = apr_time_now() + apr_time_from_sec(STREAM_SECONDS);
+
+	// the connection of the pool is only taken for each change
+	db_pool_release(&c->dbc, true);
+
+	while (ap_rflush(r) >= 0 && !r->connection->aborted && apr_time_now() < end)
+	{
+		if (!wait_room_change(room.id, version, KEEPALIVE_SECONDS))
+		{
+			ap_rputs(": keep-alive\n\n", r);
+			continue;
+		}
+
+		db_pool_acquire(&c->dbc);
+		errno_t e = refresh_feed(c, feed, version);
+		db_pool_release(&c->dbc, e == 0);
+		if (e != 0)
+			break;
+
+		char *text = take_events(feed, &cursor, args.userId);
+		if (text == NULL)
+			break; // the client will reconnect
+
+		ap_rputs(text, r);
+		_free(text, "stream_events");
+	}
+
+	unsubscribe_feed(feed);
+	db_pool_acquire(&c->dbc); // for the request to give it back
+	return OK;
+}
+
+/* the latest time given to a message id by this process */
+static volatile apr_uint64_t lastIdTime;
+
+/* Get the current time, made unique within this process */
+static time_us_t next_id_time(void)
+{
+	apr_uint64_t now = (apr_uint64_t)time_us();
+	apr_uint64_t last, next;
+	do {
+		last = apr_atomic_read64(&lastIdTime);
+		next = now > last ? now : last + 1;
+	} while (apr_atomic_cas64(&lastIdTime, next, last) != last);
+
+	return (time_us_t)next;
+}
+
+/* The room (12 digits), the microsecond made (13 digits, enough up
+ * to the year 2112), then the whole id of the process that made it
+ * (7 digits, as pid_max is at most 2^22), which tells apart the
+ * messages sent at once by two processes of the server. The ids made
+ * earlier with 16 digits of time, which start with 000, come first. */
+static void make_message_id(char id[GUID_STORE], int roomId, time_us_t dateSent)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	unsigned long long room = (unsigned long long)roomId;
+	unsigned long long date = (unsigned long long)dateSent;
+	unsigned long pid = (unsigned long)getpid();
+
+	for (int i = 11; i >= 0; i--, room >>= 4)
+		id[i] = digits[room & 15];
+
+	for (int i = 24; i >= 12; i--, date >>= 4)
+		id[i] = digits[date & 15];
+
+	for (int i = 31; i >= 25; i--, pid >>= 4)
+		id[i] = digits[pid & 15];
+
+	id[MESSAGE_ID_LENGTH] = '\0';
+}
+
+bool is_message_id(const char *id)
+{
+	if (id == NULL)
+		return false;
+
+	int i = 0;
+	while (i < MESSAGE_ID_LENGTH && isxdigit((unsigned char)id[i]))
+		i++;
+	return i == MESSAGE_ID_LENGTH && id[i] == '\0';
+}
+
+/* Rows per insert statement, 8 parameters each */
+#define INSERT_BATCH 8
+
+#define MESSAGE_VALUES "(UNHEX(?), UNHEX(?), ?, ?, ?, ?, ?, ?)"
+
+/* Insert the messages, which have their ids already */
+static errno_t insert_messages(DbContext *dbc, const Message *messages, int count, char (*ids)[GUID_STORE])
+{
+	char sql[256 + INSERT_BATCH * sizeof(MESSAGE_VALUES ",\n")];
+	JsonValue argv[INSERT_BATCH * 8];
+	char dates[INSERT_BATCH][DATE_STORE];
+
+	for (int first = 0; first < count; first += INSERT_BATCH)
+	{
+		int n = count - first < INSERT_BATCH ? count - first : INSERT_BATCH;
+
+		char *end = sql + sprintf(sql,
+			"insert into Messages\n"
+			"(Id, ParentId, RoomId, SenderId, DateSent, Type, Status, Content) VALUES\n");
+		for (int i = 0; i < n; i++)
+			end += sprintf(end, i == 0 ? MESSAGE_VALUES : ",\n" MESSAGE_VALUES);
+
+		DbQuery query = {.dbc = dbc};
+		query.sql = sql;
+
+		for (int i = 0; i < n; i++)
+		{
+			const Message *m = &messages[first + i];
+			time_us_to_string(dates[i], sizeof(dates[i]), m->dateSent, TIME_FORMAT_LOCAL);
+
+			argv[query.argc++] = json_new_str(ids[first + i], false);
+			argv[query.argc++] = json_new_str(str_empty(m->parentId) ? NULL : m->parentId, true);
+			argv[query.argc++] = json_new_int(m->roomId, false);
+			argv[query.argc++] = json_new_int(m->senderId, false);
+			argv[query.argc++] = json_new_str(dates[i], false);
+			argv[query.argc++] = json_new_int(m->type, false);
+			argv[query.argc++] = json_new_int(m->status, false);
+			argv[query.argc++] = json_new_str(m->content, false);
+		}
 
-	if (sql_exec(&query, argv) != 0)
-	{
-		cJSON_Delete(context.messages);
-		return http_problem(c, NULL, tl("An error has occurred while obtaining the messages"), 500);
+		errno_t e = sql_exec(&query, argv);
+		if (e != 0)
+			return e;
 	}
+	return 0;
+}
 
-	JsonObject *info = json_new_object();
-	json_put_number(info, "id", room.id, 0);
-	json_put_string(info, "skippedMessageId", room.skippedMessageId, 0);
+errno_t add_messages(DbContext *dbc, Message *messages, int count, char (*ids)[GUID_STORE])
+{
+	if (count <= 0)
+		return 0;
 
-	if (str_empty(room.roomName))
-		strcpy(buffer, room.groupName);
-	else sprintf(buffer, "%s: %s", room.groupName, room.roomName);
-	json_put_string(info, "name", buffer, 0);
+	char (*_ids)[GUID_STORE] = NULL;
+	if (ids == NULL)
+	{
+		ids = _ids = malloc((size_t)count * GUID_STORE);
+		if (ids == NULL)
+			return ENOMEM;
+	}
 
-	if (room.memberId != 0)
-		json_put_node(info, "joined", cJSON_CreateBool(true), 0);
+	int roomId = messages[0].roomId;
+	for (int i = 0; i < count; i++)
+	{
+		Message *m = &messages[i];
+		assert(m->roomId == roomId);
 
-	vm_add_node(c, "roomInfo", info, 0);
-	vm_add_node(c, "messages", context.messages, 0);
+		if (str_empty(m->id))
+		{
+			// the time of the id is always the server's, while
+			// the time sent may be the one given by the client
+			time_us_t idTime = next_id_time();
+			if (m->dateSent == 0)
+				m->dateSent = idTime;
+			make_message_id(ids[i], m->roomId, idTime);
+		}
+		else
+		{
+			APP_LOG(LOG_WARNING, "Message ID was provided: %s", m->id);
+			str_copy(ids[i], GUID_STORE, m->id);
+		}
 
-	return process_model(c, HTTP_OK);
-}
+		if (m->dateSent == 0)
+			m->dateSent = time_us();
 
-errno_t add_message(DbContext *dbc, Message m, char id[GUID_STORE])
-{
-	char _id[GUID_STORE];
-	if (id == NULL)
-		id = _id;
+		if (m->type == 0)
+			m->type = MessageType_Normal;
 
-	if (m.dateSent == 0)
-		m.dateSent = time_us();
+		if (m->status == 0)
+			m->status = MessageStatus_Sent;
+	}
 
-	char dateSent[DATE_STORE];
-	time_us_to_string(dateSent, sizeof(dateSent), m.dateSent, TIME_FORMAT_LOCAL);
+	// for the readers to see all of the messages, or none of them
+	errno_t e = count > 1 ? db_begin(dbc) : 0;
 
-	if (str_empty(m.id))
+	if (e == 0)
 	{
-		if ((m.dateSent % 1000) == 0) // add microseconds if not already there
-			m.dateSent += rand() % 1000;
+		e = insert_messages(dbc, messages, count, ids);
 
-		// Generate a unique ID for the message
-		sprintf(id, "%012X%016llX0000", m.roomId, m.dateSent);
+		if (count > 1)
+			e = db_end(dbc, e == 0);
 	}
+
+	if (e != 0)
+		APP_LOG(LOG_ERROR, "Failed to add %d message(s)", count);
 	else
-	{
-		APP_LOG(LOG_WARNING, "Message ID was provided: %s", m.id);
-		str_copy(id, GUID_STORE, m.id);
-	}
+		notify_room_change(roomId);
 
-	if (m.type == 0)
-		m.type = MessageType_Normal;
+	free(_ids);
+	return e;
+}
 
-	if (m.status == 0)
-		m.status = MessageStatus_Sent;
+errno_t add_message(DbContext *dbc, Message m, char id[GUID_STORE])
+{
+	char _id[1][GUID_STORE];
+	errno_t e = add_messages(dbc, &m, 1, _id);
 
-	DbQuery query = {.dbc = dbc};
-	query.sql =
-		"insert into Messages\n"
-		"(Id, ParentId, RoomId, SenderId, DateSent, Type, Status, Content) VALUES\n"
-		"(UNHEX(?), UNHEX(?), ?, ?, ?, ?, ?, ?)";
+	if (id != NULL)
+		str_copy(id, GUID_STORE, _id[0]);
+	return e;
+}
 
-	JsonValue argv[10];
+errno_t update_message_content(DbContext *dbc, int roomId, const char *id, const char *content, enum MessageStatus status)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql = "UPDATE Messages SET Content = ?, Status = ? WHERE Id = UNHEX(?)";
+	JsonValue argv[3];
+	argv[query.argc++] = json_new_str(content, false);
+	argv[query.argc++] = json_new_int(status, false);
 	argv[query.argc++] = json_new_str(id, false);
-	argv[query.argc++] = json_new_str(m.parentId, true);
-	argv[query.argc++] = json_new_int(m.roomId, false);
-	argv[query.argc++] = json_new_int(m.senderId, false);
-	argv[query.argc++] = json_new_str(dateSent, false);
-	argv[query.argc++] = json_new_int(m.type, false);
-	argv[query.argc++] = json_new_int(m.status, false);
-	argv[query.argc++] = json_new_str(m.content, false);
 
 	errno_t e = sql_exec(&query, argv);
-	if (e != 0)
-	{
-		APP_LOG(LOG_ERROR, "Failed to add the message");
-	}
-	else
-	{
-		query.sql = "UPDATE Rooms SET LatestMessageId = UNHEX(?) WHERE Id = ?";
-		query.argc = 0;
-		argv[query.argc++] = json_new_str(id, false);
-		argv[query.argc++] = json_new_int(m.roomId, false);
-		sql_exec(&query, argv);
-	}
+	if (e == 0)
+		notify_room_change(roomId);
 	return e;
 }
 
@@ -291,6 +1328,44 @@ errno_t update_room_state(DbContext *dbc, int roomId, enum RoomState state)
 	JsonValue argv[2];
 	argv[query.argc++] = json_new_int(state, false);
 	argv[query.argc++] = json_new_int(roomId, false);
+
+	errno_t e = sql_exec(&query, argv);
+	if (e == 0)
+	{
+		notify_room_info_change(roomId);
+		notify_room_change(roomId);
+	}
+	return e;
+}
+
+/* Set the messages of the room as read by the user, up to the one
+ * given, with the count of those read, see ViewRoomMembers.UnreadCount.
+ * Only for a member of the group, and never going back. */
+static errno_t set_last_read(DbContext *dbc, int roomId, const char *id, long userId)
+{
+	DbQuery query = {.dbc = dbc};
+
+	// ReadCount first, as it depends on the LastReadMessageId before
+	query.sql =
+		"INSERT INTO RoomMembers (RoomId, MemberId, LastReadMessageId, ReadCount)\n"
+		"SELECT r.Id, gm.MemberId, UNHEX(?), r.MessageCount - (\n"
+		"\tSELECT COUNT(*) FROM Messages AS m\n"
+		"\tWHERE m.RoomId = r.Id AND m.Id > UNHEX(?) AND m.Type != 2 AND m.DateDeleted IS NULL)\n"
+		"FROM Rooms AS r\n"
+		"JOIN GroupMembers AS gm ON gm.GroupId = r.GroupId\n"
+		"WHERE r.Id = ? AND gm.MemberId = ?\n"
+		"ON DUPLICATE KEY UPDATE\n"
+		"\tReadCount = IF(RoomMembers.LastReadMessageId IS NULL OR RoomMembers.LastReadMessageId < VALUES(LastReadMessageId),\n"
+		"\tVALUES(ReadCount), RoomMembers.ReadCount),\n"
+		"\tLastReadMessageId = IF(RoomMembers.LastReadMessageId IS NULL OR RoomMembers.LastReadMessageId < VALUES(LastReadMessageId),\n"
+		"\tVALUES(LastReadMessageId), RoomMembers.LastReadMessageId)\n";
+
+	JsonValue argv[4];
+	argv[query.argc++] = json_new_str(id, false);
+	argv[query.argc++] = json_new_str(id, false);
+	argv[query.argc++] = json_new_int(roomId, false);
+	argv[query.argc++] = json_new_long(userId, false);
+
 	return sql_exec(&query, argv);
 }
 
@@ -319,7 +1394,7 @@ static apr_status_t send_message(HttpContext *c)
 		goto finish;
 	}
 
-	UrlArgs args;
+	UrlArgs args = {0};
 	args.userId = atoi(c->identity.sub);
 	args.roomId = (int)json_get_number(msg, "roomId");
 
@@ -344,6 +1419,17 @@ static apr_status_t send_message(HttpContext *c)
 			status = HTTP_BAD_REQUEST;
 			goto finish;
 		}
+
+		time_us_t now = time_us();
+		if (m.dateSent > now)
+			m.dateSent = now; // the clock of the client is ahead
+	}
+
+	if (!str_empty(m.parentId) && !is_message_id(m.parentId))
+	{
+		strcpy(buffer, tl("Invalid message id provided"));
+		status = HTTP_BAD_REQUEST;
+		goto finish;
 	}
 
 	if (str_empty(m.content))
@@ -366,44 +1452,38 @@ static apr_status_t send_message(HttpContext *c)
 		str_starts_with(m.content, "@AI ", StringCompare_CaseInsensitive) ||
 		str_starts_with(m.content, "@IA ", StringCompare_CaseInsensitive);
 
-	if (sendToAI && room.state == RoomState_AIBusy)
-	{
-		strcpy(buffer, tl("AI is busy, please wait"));
-		status = HTTP_SERVICE_UNAVAILABLE;
-		goto finish;
-	}
-
-	char id[GUID_STORE] = {0};
-	if (add_message(&c->dbc, m, id) != 0)
+	char ids[1][GUID_STORE] = {{0}};
+	if (add_messages(&c->dbc, &m, 1, ids) != 0)
 	{
 		strcpy(buffer, tl("Failed to add the message"));
 		status = HTTP_INTERNAL_SERVER_ERROR;
 		goto finish;
 	}
+	const char *id = ids[0];
+
+	// my own message is not unread by me
+	set_last_read(&c->dbc, m.roomId, id, args.userId);
+
+	// as committed, for the client to place the message at once
+	char stored[DATE_STORE];
+	time_us_to_string(stored, sizeof(stored), m.dateSent, TIME_FORMAT_LOCAL);
+	local_to_utc(buffer, sizeof(buffer), stored);
 
 	vm_add(c, "id", id, 0);
+	vm_add(c, "dateSent", buffer, 0);
 	if (sendToAI)
 	{
-		if (update_room_state(&c->dbc, m.roomId, RoomState_AIBusy) != 0)
+		// which sets the room busy
+		if (queue_ai_job(&c->dbc, m.roomId, id) != 0)
 		{
 			strcpy(buffer, tl("An error has occurred while updating the room state"));
 			status = 500;
 			goto finish;
 		}
 
-		str_lit_t tracker = "send_to_ai";
-		struct send_to_ai *data = _malloc(sizeof(struct send_to_ai), tracker);
-		data->app_backup.malloc_tracker = tracker;
-
-		get_app_backup(&data->app_backup, get_app());
-		str_copy(data->messageId, GUID_STORE, id); // id is valid at this point
-		data->roomId = m.roomId;
-
-		apr_pool_cleanup_register(c->request->pool, data, (apr_status_t (*)(void *))send_message_to_ai, apr_pool_cleanup_null);
-
-		// Close the connection:
-		c->request->connection->keepalive = AP_CONN_CLOSE;
-		apr_table_set(c->request->headers_out, "Connection", "close");
+		// replies are given in turn, so it may be after others
+		if (room.state == RoomState_AIBusy)
+			vm_add_node(c, "ai_is_queued", cJSON_CreateBool(true), 0);
 
 		vm_add_node(c, "ai_is_busy", cJSON_CreateBool(true), 0);
 	}
@@ -421,7 +1501,7 @@ finish:
 struct m_info
 {
 	int userId;
-	char parentId[48];
+	char parentId[GUID_STORE];
 };
 
 static errno_t m_info_callback(void *context, int argc, char **argv, char **columns)
@@ -439,42 +1519,64 @@ static apr_status_t sent_or_caused_by_me(HttpContext *c, const char *id)
 	int currentUserId = atoi(c->identity.sub);
 	struct m_info info = {0};
 
+	// walk up the messages sent by AI (user 1), in one query,
+	// and get the one where it stops
 	DbQuery query = {.dbc = &c->dbc};
 	query.callback = m_info_callback;
 	query.callback_context = &info;
-	query.sql = "select UserId, ParentId from ViewMessages where Id = ?";
-	JsonValue argv[1];
+	query.sql =
+		"with recursive chain (ParentId, UserId, Depth) as (\n"
+		"  select m.ParentId, s.UserId, 0\n"
+		"  from Messages as m\n"
+		"  join Sessions as s on s.Id = m.SenderId\n"
+		"  where m.Id = UNHEX(?)\n"
+		"  union all\n"
+		"  select m.ParentId, s.UserId, chain.Depth + 1\n"
+		"  from chain\n"
+		"  join Messages as m on m.Id = chain.ParentId\n"
+		"  join Sessions as s on s.Id = m.SenderId\n"
+		"  where chain.UserId = 1 and chain.UserId != ? and m.Type != 2\n"
+		")\n"
+		"select UserId, HEX(ParentId)\n"
+		"from chain\n"
+		"order by Depth desc limit 1\n";
+
+	JsonValue argv[2];
+	argv[query.argc++] = json_new_str(id, false);
+	argv[query.argc++] = json_new_int(currentUserId, false);
 
-	while (true)
+	if (sql_exec(&query, argv) != 0)
 	{
-		argv[0] = json_new_str(id, false);
-		query.argc = 1;
+		sprintf(buffer, tl("Failed to get info of message %s"), id);
+		return http_problem(c, NULL, buffer, HTTP_INTERNAL_SERVER_ERROR);
+	}
 
-		info.userId = 0; // clear first
-		if (sql_exec(&query, argv) != 0)
-		{
-			sprintf(buffer, tl("Failed to get info of message %s"), id);
-			return http_problem(c, NULL, buffer, HTTP_INTERNAL_SERVER_ERROR);
-		}
+	if (info.userId == 0)
+	{
+		sprintf(buffer, tl("Message %s not found"), id);
+		return http_problem(c, NULL, buffer, HTTP_NOT_FOUND);
+	}
 
-		if (info.userId == 0)
-		{
-			sprintf(buffer, tl("Message %s not found"), id);
-			return http_problem(c, NULL, buffer, HTTP_NOT_FOUND);
-		}
+	if (info.userId == currentUserId)
+		return OK; // message was sent or caused by me
 
-		if (info.userId == currentUserId)
-			return OK; // message was sent or caused by me
+	if (info.userId == 1 && !str_empty(info.parentId))
+	{
+		// the walk stopped as the parent was not found
+		sprintf(buffer, tl("Message %s not found"), info.parentId);
+		return http_problem(c, NULL, buffer, HTTP_NOT_FOUND);
+	}
 
-		if (info.userId != 1 || str_empty(info.parentId))
-		{
-			strcpy(buffer, tl("This message was not sent nor caused by you"));
-			return http_problem(c, NULL, buffer, HTTP_FORBIDDEN);
-		}
+	strcpy(buffer, tl("This message was not sent nor caused by you"));
+	return http_problem(c, NULL, buffer, HTTP_FORBIDDEN);
+}
 
-		id = info.parentId;
-	}
-	return OK;
+/* Get the room of a message, from the id made by add_message() */
+static int get_message_room_id(const char *id)
+{
+	char hex[13];
+	str_copy(hex, sizeof(hex), id);
+	return (int)strtol(hex, NULL, 16);
 }
 
 static apr_status_t validate_message_id(HttpContext *c, const char *id)
@@ -482,7 +1584,7 @@ static apr_status_t validate_message_id(HttpContext *c, const char *id)
 	if (str_empty(id))
 		return http_problem(c, NULL, tl("Message id not provided"), HTTP_BAD_REQUEST);
 
-	else if (!is_sql_safe(id, GUID_STORE))
+	else if (!is_message_id(id))
 		return http_problem(c, NULL, tl("Invalid message id provided"), HTTP_BAD_REQUEST);
 
 	else return OK;
@@ -515,8 +1617,17 @@ static apr_status_t delete_message(HttpContext *c)
 	if (status != OK)
 		return status;
 
+	// no longer counted in the room, nor as read by those who read it;
+	// a multiple-table update changes each row once, however joined
 	DbQuery query = {.dbc = &c->dbc};
-	query.sql = "Update Messages set DateDeleted = CURRENT_TIMESTAMP(6) where Id = UNHEX(?)";
+	query.sql =
+		"UPDATE Messages AS m\n"
+		"JOIN Rooms AS r ON r.Id = m.RoomId\n"
+		"LEFT JOIN RoomMembers AS rm ON rm.RoomId = m.RoomId AND rm.LastReadMessageId >= m.Id\n"
+		"SET m.DateDeleted = CURRENT_TIMESTAMP(6),\n"
+		"\tr.MessageCount = r.MessageCount - (m.Type != 2),\n"
+		"\trm.ReadCount = rm.ReadCount - (m.Type != 2)\n"
+		"WHERE m.Id = UNHEX(?) AND m.DateDeleted IS NULL\n";
 
 	JsonValue argv[1];
 	argv[query.argc++] = json_new_str(id, false);
@@ -524,6 +1635,14 @@ static apr_status_t delete_message(HttpContext *c)
 	if (sql_exec(&query, argv) != 0)
 		return http_problem(c, NULL, tl("Failed to delete the message"), 500);
 
+	// the AI must no longer see it, so it gets the full history again
+	int roomId = get_message_room_id(id);
+	query.sql = "UPDATE Rooms SET AIResponseId = NULL WHERE Id = ?";
+	query.argc = 0;
+	argv[query.argc++] = json_new_int(roomId, false);
+	sql_exec(&query, argv);
+
+	notify_room_change(roomId);
 	return HTTP_NO_CONTENT;
 }
 
@@ -539,7 +1658,7 @@ static apr_status_t hide_message_from_ai(HttpContext *c)
 	query.sql =
 		"UPDATE Rooms AS r\n"
 		"JOIN Messages AS m ON m.RoomId = r.Id\n"
-		"SET r.SkippedMessageId = m.Id\n"
+		"SET r.SkippedMessageId = m.Id, r.AIResponseId = NULL\n"
 		"WHERE m.Id = UNHEX(?)\n";
 
 	JsonValue argv[1];
@@ -548,6 +1667,25 @@ static apr_status_t hide_message_from_ai(HttpContext *c)
 	if (sql_exec(&query, argv) != 0)
 		return http_problem(c, NULL, tl("Failed to hide the message from AI"), 500);
 
+	int roomId = get_message_room_id(id);
+	notify_room_info_change(roomId);
+	notify_room_change(roomId);
+	return HTTP_NO_CONTENT;
+}
+
+/* Mark the messages of the room as read by me, up to the one given.
+ * The unread count is of those after it, see get_rooms(). */
+static apr_status_t mark_messages_read(HttpContext *c)
+{
+	char id[GUID_STORE];
+
+	apr_status_t status = get_and_validate_message_id(c, id, false);
+	if (status != OK)
+		return status;
+
+	if (set_last_read(&c->dbc, get_message_room_id(id), id, str_to_long(c->identity.sub)) != 0)
+		return http_problem(c, NULL, tl("Failed to mark the messages as read"), 500);
+
 	return HTTP_NO_CONTENT;
 }
 
@@ -556,6 +1694,8 @@ struct voice_info
 	int roomId;
 	char voice_file[FILE_PATH_STORE];
 	char *message_content;
+	char key[VOICE_KEY_LENGTH + 1]; // of the words, once looked up
+	bool locked; // to make the voice, see lock_voice()
 };
 
 static errno_t get_voice_info(void *context, int argc, char **argv, char **columns)
@@ -570,20 +1710,13 @@ static errno_t get_voice_info(void *context, int argc, char **argv, char **colum
 	return 0;
 }
 
-static apr_status_t read_aloud(HttpContext *c)
+/* Get the voice of the message, else its content to make one. */
+static errno_t query_voice_info(DbContext *dbc, const char *id, struct voice_info *info)
 {
-	char id[GUID_STORE];
-
-	apr_status_t status = get_and_validate_message_id(c, id, false);
-	if (status != OK)
-		return status;
-
-	char buffer[1024];
-	struct voice_info info = {0};
-	DbQuery query = {.dbc = &c->dbc};
+	DbQuery query = {.dbc = dbc};
 
 	query.callback = get_voice_info;
-	query.callback_context = &info;
+	query.callback_context = info;
 
 	query.sql = "SELECT m.RoomId, voice.Path,\n"
 		"IF(voice.Id IS NULL, m.Content, NULL) AS Content\n"
@@ -591,85 +1724,286 @@ static apr_status_t read_aloud(HttpContext *c)
 		"LEFT JOIN FilePaths as voice on voice.Id = m.FileId\n"
 		"WHERE m.Id = UNHEX(?) AND m.DateDeleted IS NULL\n";
 
+	JsonValue argv[1];
+	argv[query.argc++] = json_new_str(id, false);
+
+	return sql_exec(&query, argv);
+}
+
+static void set_message_voice(DbContext *dbc, const char *id, row_id_t fileId)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql = "UPDATE Messages SET FileId = ? WHERE Id = UNHEX(?)";
+
 	JsonValue argv[2];
+	argv[query.argc++] = json_new_long(fileId, false);
 	argv[query.argc++] = json_new_str(id, false);
+	sql_exec(&query, argv);
+}
 
-	if (sql_exec(&query, argv) != 0)
+/* Give the message the voice of the same words if made before. Else
+ * return ENOENT, with info->locked so that the voice is made only once. */
+static errno_t find_or_lock_voice(HttpContext *c, const char *id, struct voice_info *info)
+{
+	struct tts_input in = {.input = info->message_content};
+	if (voice_key(info->key, in) != 0)
+		return ENOENT; // made without being shared, see store_voice_file()
+
+	row_id_t fileId = 0;
+	errno_t e = find_voice_file(&c->dbc, info->key, &fileId, info->voice_file);
+	if (e == ENOENT)
 	{
-		strcpy(buffer, tl("Internal error: failed to get data"));
-		status = 500;
-		goto finish;
+		e = lock_voice(&c->dbc, info->key, VOICE_WAIT);
+		if (e != 0)
+			return e;
+
+		// it may have been made while waiting
+		e = find_voice_file(&c->dbc, info->key, &fileId, info->voice_file);
+		if (e == ENOENT)
+		{
+			info->locked = true;
+			return e;
+		}
+		unlock_voice(&c->dbc, info->key);
 	}
 
-	// TODO: check if user is a member of the room
+	if (e == 0)
+		set_message_voice(&c->dbc, id, fileId);
+	return e;
+}
+
+/* Store uf->data as the voice of the message, and of its words. */
+static errno_t store_voice_file(HttpContext *c, const char *id, UploadFile *uf, struct voice_info *info, Charray *buf)
+{
+	uf->sessionId = str_to_long(c->identity.sid);
+
+	strcpy(uf->folder, "ai_voice");
+	sprintf(uf->name, "%s.mp3", id);
+
+	// provide the filename seen by user upon download
+	uf->data.disposition.filename = "DRIIMA-voice.mp3";
+
+	errno_t e = complete_file_upload(&c->dbc, uf, buf);
+	if (e != 0)
+		return e;
+
+	set_message_voice(&c->dbc, id, uf->id);
+
+	if (!str_empty(info->key) && add_voice_file(&c->dbc, info->key, uf->id) != 0)
+		APP_LOG(LOG_ERROR, "Failed to remember the voice of %s", id);
+
+	sprintf(info->voice_file, "%s/%s", uf->folder, uf->name);
+	return 0;
+}
+
+/* The voice being made, sent to the client and kept in a file */
+struct voice_stream
+{
+	request_rec *request;
+	apr_file_t *file; // the copy to store, NULL if it cannot be kept
+	bool sent; // if any of it got to the client
+	bool aborted; // by the client
+};
+
+static bool send_voice_piece(void *context, const char *data, size_t size)
+{
+	struct voice_stream *v = (struct voice_stream *)context;
+	request_rec *r = v->request;
 
-	if (str_empty(info.voice_file))
+	if (v->file != NULL && apr_file_write_full(v->file, data, size, NULL) != APR_SUCCESS)
 	{
-		if (str_empty(info.message_content))
-		{
-			strcpy(buffer, tl("The message appears to have been deleted."));
-			status = 400;
-			goto finish;
-		}
+		APP_LOG(LOG_ERROR, "Failed to keep the voice being streamed");
+		apr_file_close(v->file);
+		v->file = NULL;
+	}
 
-		struct tts_input in = {
-			.input = info.message_content,
-			.dbc = &c->dbc,
-			.messageId = id
-		};
-		struct tts_output out = {.content = new_char_array(NULL)};
-		Charray buf = buffer_to_char_array(buffer, sizeof(buffer));
+	if (!v->aborted)
+	{
+		if (!v->sent)
+			ap_set_content_type(r, "audio/mpeg");
 
-		errno_t e = text_to_speech(&out, in, &buf);
-		if (e != 0)
-		{
-			status = errno_to_status_code(e);
-			goto finish;
-		}
+		// flush so that the client can start playing it
+		v->sent = true;
+		if (ap_rwrite(data, (int)size, r) < 0 || ap_rflush(r) < 0)
+			v->aborted = true;
+	}
+
+	// go on while it is still wanted
+	return v->file != NULL || !v->aborted;
+}
 
-		UploadFile uf = {0};
-		uf.sessionId = str_to_long(c->identity.sid);
+/* Store the voice kept by send_voice_piece(), without reading it to memory. */
+static errno_t store_voice_stream(HttpContext *c, const char *id, struct voice_stream *v, struct voice_info *info, Charray *buf)
+{
+	// end it as array_to_string() would
+	if (apr_file_write_full(v->file, "", 1, NULL) != APR_SUCCESS)
+		return EIO;
 
-		uf.data.content = array_to_string(&out.content);
-		uf.data.content_type.value = out.content_type;
+	apr_finfo_t finfo;
+	if (apr_file_info_get(&finfo, APR_FINFO_SIZE, v->file) != APR_SUCCESS || finfo.size <= 1)
+		return EIO;
 
-		strcpy(uf.folder, "ai_voice");
-		sprintf(uf.name, "%s.mp3", id);
+	apr_mmap_t *mm = NULL;
+	if (apr_mmap_create(&mm, v->file, 0, (apr_size_t)finfo.size, APR_MMAP_READ, c->request->pool) != APR_SUCCESS)
+		return EIO;
 
-		// provide the filename seen by user upon download
-		uf.data.disposition.filename = "DRIIMA-voice.mp3";
+	UploadFile uf = {0};
+	uf.data.content = mm->mm;
+	uf.data.content_type.value = "audio/mpeg";
 
-		e = complete_file_upload(&c->dbc, &uf, &buf);
-		charray_free(&out.content); // free memory
+	errno_t e = store_voice_file(c, id, &uf, info, buf);
+	apr_mmap_delete(mm);
+	return e;
+}
 
-		if (e != 0)
-			goto finish;
+/* Make the voice of the message, giving it to the client unless v->aborted.
+ * Once all made it is stored, and info->voice_file is set if that worked. */
+static errno_t make_voice(HttpContext *c, const char *id, struct voice_info *info, struct voice_stream *v, Charray *buf)
+{
+	request_rec *r = c->request;
+
+	// keep a copy on disk, deleted once closed
+	const char *dir = NULL;
+	if (apr_temp_dir_get(&dir, r->pool) != APR_SUCCESS ||
+		apr_file_mktemp(&v->file, apr_pstrcat(r->pool, dir, "/driima-voice-XXXXXX", NULL),
+			APR_FOPEN_CREATE | APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_EXCL | APR_FOPEN_DELONCLOSE,
+			r->pool) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to create a file for the voice of %s", id);
+		v->file = NULL; // still sent, but to be made again next time
+	}
+
+	struct tts_input in = {
+		.input = info->message_content,
+		.messageId = id
+	};
+	errno_t e = text_to_speech_stream(in, send_voice_piece, v, buf);
+
+	if (e == 0 && v->file != NULL)
+	{
+		Charray err = new_char_array(NULL);
+		if (store_voice_stream(c, id, v, info, &err) != 0)
+			APP_LOG(LOG_ERROR, "Failed to store the voice of %s: %s", id, err.data);
+		charray_free(&err);
+	}
+
+	if (v->file != NULL)
+		apr_file_close(v->file);
+	v->file = NULL;
+	return e;
+}
+
+/* Get the voice of the message for a member of its room, else its words
+ * to make one, with info->locked for it to be made only once. */
+static apr_status_t find_message_voice(HttpContext *c, const char *id, struct voice_info *info, char *buffer)
+{
+	if (query_voice_info(&c->dbc, id, info) != 0)
+	{
+		strcpy(buffer, tl("Internal error: failed to get data"));
+		return 500;
+	}
+
+	if (info->roomId == 0)
+	{
+		strcpy(buffer, tl("The message appears to have been deleted."));
+		return 400;
+	}
+
+	// the voice costs to make, so only for those who can see the message
+	UrlArgs args = {0};
+	args.userId = atoi(c->identity.sub);
+	args.roomId = info->roomId;
+
+	RoomInfo room;
+	apr_status_t status = get_room_info(c, &room, args, buffer, false);
+	if (status != OK || !str_empty(info->voice_file))
+		return status;
+
+	if (str_empty(info->message_content))
+	{
+		strcpy(buffer, tl("The message appears to have been deleted."));
+		return 400;
+	}
+
+	// the same words may have been spoken before
+	errno_t e = find_or_lock_voice(c, id, info);
+	if (e != 0 && e != ENOENT)
+	{
+		strcpy(buffer, e == ETIMEDOUT
+			? tl("The voice is still being made, please try again")
+			: tl("Internal error: failed to get data"));
+		return e == ETIMEDOUT ? 503 : 500;
+	}
+	return OK;
+}
+
+/* Send the voice of the message, while being made if not yet made. */
+static apr_status_t stream_voice(HttpContext *c)
+{
+	char id[GUID_STORE];
+
+	apr_status_t status = get_and_validate_message_id(c, id, false);
+	if (status != OK)
+		return status;
+
+	request_rec *r = c->request;
+	char buffer[1024];
+	Charray buf = buffer_to_char_array(buffer, sizeof(buffer));
+	struct voice_info info = {0};
+	struct voice_stream v = {.request = r};
 
-		query.callback = NULL;
-		query.sql = "UPDATE Messages SET FileId = ? WHERE Id = UNHEX(?)";
-		query.argc = 0;
-		argv[query.argc++] = json_new_long(uf.id, false);
-		argv[query.argc++] = json_new_str(id, false);
-		sql_exec(&query, argv);
+	status = find_message_voice(c, id, &info, buffer);
+	if (status != OK)
+		goto finish;
 
-		sprintf(info.voice_file, "%s/%s", uf.folder, uf.name);
+	if (!str_empty(info.voice_file))
+	{
+		if (!file_path_to_full_url(c, buffer, sizeof(buffer), info.voice_file))
+		{
+			status = 500;
+			goto finish;
+		}
+		apr_table_setn(r->headers_out, "Location", apr_pstrdup(r->pool, buffer));
+		status = HTTP_MOVED_TEMPORARILY;
+		goto finish;
 	}
 
-	if (!file_path_to_full_url(c, buffer, sizeof(buffer), info.voice_file))
-		status = 500;
+	errno_t e = make_voice(c, id, &info, &v, &buf);
+
+	if (!v.sent)
+	{
+		if (e == 0)
+			strcpy(buffer, tl("No voice was made"));
+		status = e ? errno_to_status_code(e) : 502;
+		goto finish;
+	}
 
-	vm_add_string(c, "url", buffer, 0);
+	if (e != 0)
+	{
+		// too late for a problem detail, so cut it short
+		APP_LOG(LOG_ERROR, "Voice of %s cut short: %s", id, buffer);
+		r->connection->keepalive = AP_CONN_CLOSE;
+	}
 
 finish:
-	if (status == OK)
-		status = process_model(c, HTTP_OK);
-	else
+	if (status != OK && status != HTTP_MOVED_TEMPORARILY)
 		status = http_problem(c, NULL, buffer, status);
 
+	if (info.locked)
+		unlock_voice(&c->dbc, info.key);
+
 	_free(info.message_content, "info_message_content");
 	return status;
 }
 
+static errno_t group_room_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(1);
+	(void)context;
+	notify_room_info_change(atoi(argv[0]));
+	return 0;
+}
+
 static apr_status_t join_group(HttpContext *c)
 {
 	UrlArgs args = get_url_args(c);
@@ -696,6 +2030,28 @@ static apr_status_t join_group(HttpContext *c)
 		return HTTP_INTERNAL_SERVER_ERROR;
 	}
 
+	// the messages sent before joining are not unread
+	query.sql =
+		"INSERT INTO RoomMembers (RoomId, MemberId, LastReadMessageId, ReadCount)\n"
+		"SELECT Id, ?, COALESCE(LatestMessageId, X'00000000000000000000000000000000'), MessageCount\n"
+		"FROM Rooms WHERE GroupId = ?\n"
+		"ON DUPLICATE KEY UPDATE\n"
+		"\tReadCount = IF(RoomMembers.LastReadMessageId IS NULL, VALUES(ReadCount), RoomMembers.ReadCount),\n"
+		"\tLastReadMessageId = COALESCE(RoomMembers.LastReadMessageId, VALUES(LastReadMessageId))\n";
+	query.argc = 0;
+	argv[query.argc++] = json_new_int(args.userId, false);
+	argv[query.argc++] = json_new_int(room.groupId, false);
+	sql_exec(&query, argv);
+
+	// now a member of all the rooms of the group, whose cached info says otherwise
+	query.callback = group_room_callback;
+	query.sql = "SELECT Id FROM Rooms WHERE GroupId = ?";
+	query.argc = 0;
+	argv[query.argc++] = json_new_int(room.groupId, false);
+
+	if (sql_exec(&query, argv) != 0)
+		notify_room_info_change(room.id); // at least this one
+
 	return HTTP_NO_CONTENT;
 }
 
@@ -757,16 +2113,21 @@ static apr_status_t anonymous_chat(HttpContext *c)
 void register_message_controller(void)
 {
 	CHECK_ERRNO;
+	init_room_feeds();
+	init_room_cache();
+
 	add_endpoint(M_GET, "/anonymous/chat", anonymous_chat, 0); // obsolete
 	add_endpoint(M_GET, "/", home_page, 0);
 	add_endpoint(M_GET, "/chat", chat_page, 0);
 
 	add_endpoint(M_GET, "/api/room/messages", get_messages, Endpoint_AuthWebAPI);
+	add_endpoint(M_GET, "/api/room/stream", stream_messages, Endpoint_AuthWebAPI);
 	add_endpoint(M_GET, "/api/message/many", get_messages, Endpoint_AuthWebAPI); // obsolete
 	add_endpoint(M_POST, "/api/room/join", join_group, Endpoint_AuthWebAPI);
 
 	add_endpoint(M_POST, "/api/message/send", send_message, Endpoint_AuthWebAPI);
 	add_endpoint(M_DELETE, "/api/message/delete", delete_message, Endpoint_AuthWebAPI);
 	add_endpoint(M_PATCH, "/api/message/hide-from-ai", hide_message_from_ai, Endpoint_AuthWebAPI);
-	add_endpoint(M_GET, "/api/message/read-aloud", read_aloud, Endpoint_AuthWebAPI);
+	add_endpoint(M_PATCH, "/api/message/mark-read", mark_messages_read, Endpoint_AuthWebAPI);
+	add_endpoint(M_GET, "/api/message/voice", stream_voice, Endpoint_AuthWebAPI);
 }
@@ -1,73 +1,138 @@
 #include "base.h"
 
+struct rooms_etag
+{
+	unsigned long long hash;
+	int count;
+};
+
 struct get_rooms
 {
 	HttpContext *c;
-	JsonArray *rooms;
+	JsonWriter *w;
+	struct rooms_etag etag; // of the rows written
 };
 
-static errno_t get_rooms_callback(void *context, int argc, char **argv, char **columns)
+/* Write the date, which is stored in local time */
+static void write_date(JsonWriter *w, const char *name, const char *value)
 {
-	struct get_rooms *info = (struct get_rooms *)context;
+	char str[64];
+	if (value == NULL)
+		jw_string(w, name, NULL);
+	else
+	{
+		local_to_utc(str, sizeof(str), value);
+		jw_string(w, name, str);
+	}
+}
 
-	JsonArray *room = json_new_object();
-	json_array_add(info->rooms, room);
+/* FNV-1a, as make_etag(), with NULL told apart from any string */
+static void hash_value(struct rooms_etag *etag, const char *value)
+{
+	etag->hash ^= value == NULL ? 0u : 1u;
+	etag->hash *= 1099511628211ULL;
 
-	const char *logo = NULL, *banner = NULL;
+	if (value == NULL)
+		return;
 
-	for (int i = 0; i < argc; i++)
+	for (const char *s = value; ; s++)
 	{
-		KeyValuePair x = {columns[i], argv[i]};
-		json_kvp_number(room, x, "roomId");
-		json_kvp_number(room, x, "groupId");
-		json_kvp_string(room, x, "roomName");
-		json_kvp_string(room, x, "groupName");
-		json_kvp_number(room, x, "groupStatus");
-		json_kvp_number(room, x, "memberStatus");
-		json_kvp_date_l(room, x, "dateMuted");
-		json_kvp_date_l(room, x, "datePinned");
-		json_kvp_date_l(room, x, "latestDateSent");
-		json_kvp_string(room, x, "latestMessage");
-		KVP_TO_STR(x, logo, "groupLogo");
-		KVP_TO_STR(x, banner, "groupBanner");
+		etag->hash ^= (unsigned char)*s; // the NUL ends the value
+		etag->hash *= 1099511628211ULL;
+		if (*s == '\0')
+			break;
 	}
+}
 
-	char buffer[MIN_BUFFER_SIZE];
+static errno_t get_rooms_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(13);
+	struct get_rooms *info = (struct get_rooms *)context;
+	JsonWriter *w = info->w;
+
+	if (w->request->connection->aborted)
+		return ECONNABORTED; // no need to read the rest
+
+	for (int i = 0; i < argc; i++)
+		hash_value(&info->etag, argv[i]);
+	info->etag.count++;
+
+	jw_begin(w, NULL, '{');
+	jw_number(w, "roomId", atol(argv[0]));
+	jw_number(w, "groupId", atol(argv[1]));
+	jw_string(w, "roomName", argv[2]);
+	jw_string(w, "groupName", argv[3]);
+	jw_number(w, "groupStatus", atol(argv[4]));
+	jw_number(w, "memberStatus", atol(argv[5]));
+	write_date(w, "dateMuted", argv[6]);
+	write_date(w, "datePinned", argv[7]);
+	write_date(w, "latestDateSent", argv[8]);
+	jw_string(w, "latestMessage", argv[9]);
+	jw_number(w, "unreadCount", atol(argv[12]));
+
+	const char *logo = argv[10];
 	if (str_empty(logo))
-		logo = banner;
+		logo = argv[11];
 
+	char buffer[MIN_BUFFER_SIZE];
 	if (file_path_to_full_url(info->c, buffer, sizeof(buffer), logo))
-		json_put_string(room, "logo", buffer, 0);
+		jw_string(w, "logo", buffer);
 
+	jw_end(w, '{');
 	return 0;
 }
 
 static apr_status_t get_rooms(HttpContext *c)
 {
-	JsonArray *rooms = json_new_array();
-	vm_add_node(c, "rooms", rooms, 0);
+	long userId = str_to_long(c->identity.sub);
+
+	JsonWriter w[1];
+	jw_init(w, c);
+
+	jw_begin(w, NULL, '{');
+	jw_begin(w, "rooms", '[');
+
+	// the rows are written as they are read
+	struct get_rooms info = {c, w, {14695981039346656037ULL, 0}};
 
 	DbQuery query = {.dbc = &c->dbc};
 	query.callback = get_rooms_callback;
-
-	struct get_rooms info = {c, rooms};
 	query.callback_context = &info;
 
+	// the unread counts are kept as the messages are sent and read
 	query.sql =
-		"select * from ViewRooms as r\n"
-		"join ViewRoomMembers as rm on rm.RoomId = r.Id\n"
-		"where MemberId = ?\n"
+		"select r.Id, r.GroupId, r.RoomName, r.GroupName, r.GroupStatus, rm.MemberStatus,\n"
+		"\trm.DateMuted, rm.DatePinned, r.LatestDateSent, r.LatestMessage, r.GroupLogo, r.GroupBanner,\n"
+		"\trm.UnreadCount\n"
+		"from ViewRoomMembers as rm\n"
+		"join ViewRooms as r on r.Id = rm.RoomId\n"
+		"where rm.MemberId = ?\n"
 		"order by LatestDateSent desc, GroupName asc\n";
 
-	long userId = str_to_long(c->identity.sub);
 	JsonValue argv[1];
 	argv[0] = json_new_long(userId, false);
 	query.argc = 1;
 
 	if (sql_exec(&query, argv) != 0)
-		return http_problem(c, NULL, tl("Internal error: failed to get data"), 500);
+		return jw_fail(w, c, tl("Internal error: failed to get data"));
 
-	return process_model(c, HTTP_OK);
+	jw_end(w, '[');
+	jw_end(w, '{');
+
+	// the rows are all of the response, so tell it apart, unless
+	// too long to be held until now, the headers being sent with it
+	if (!w->sent)
+	{
+		char buffer[MIN_BUFFER_SIZE];
+		sprintf(buffer, "%ld|%d|%016llx", userId, info.etag.count, info.etag.hash);
+
+		char etag[ETAG_STORE];
+		make_etag(etag, 'r', buffer);
+
+		if (etag_matches(c, etag))
+			return HTTP_NOT_MODIFIED; // what was written is dropped
+	}
+	return jw_finish(w);
 }
 
 void register_room_controller(void)
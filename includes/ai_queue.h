@@ -0,0 +1,16 @@
+#ifndef _AI_QUEUE_H_
+#define _AI_QUEUE_H_
+
+#include <db_context.h>
+
+/* Background threads per server process replying as AI */
+#define AI_WORKERS 2
+
+/* Start the AI workers of this server process. */
+errno_t ai_queue_init(apr_pool_t *pool);
+
+/* Queue a reply to the message, to be given in the order of the room,
+ * which is set busy with it. */
+errno_t queue_ai_job(DbContext *dbc, int roomId, const char messageId[GUID_STORE]);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _DB_POOL_H_
+#define _DB_POOL_H_
+
+#include <db_context.h>
+
+/* Create the per-process pool of database connections. */
+errno_t db_pool_init(apr_pool_t *pool);
+
+/* Borrow a live connection, or open a new one if none is idle. */
+void db_pool_acquire(DbContext *dbc);
+
+/* Give back the connection. It is closed instead if not healthy
+ * or if the pool is full. The dbc is always cleared afterwards. */
+void db_pool_release(DbContext *dbc, bool healthy);
+
+/* Start a transaction, for the statements that follow on the dbc
+ * to be all kept or none of them. It is rolled back if the dbc is
+ * given back with it still open. Return EALREADY if already started. */
+errno_t db_begin(DbContext *dbc);
+
+/* Commit the transaction if ok, else roll it back. Return 0 only
+ * if it was committed, or if there was no transaction but ok. */
+errno_t db_end(DbContext *dbc, bool ok);
+
+/* Take the named lock (MySQL GET_LOCK) on the connection of the dbc,
+ * waiting at most the seconds given. Return ETIMEDOUT if not taken.
+ * It is lost if the connection is. A pooled connection given back
+ * still holding one is closed, which releases it. */
+errno_t db_lock(DbContext *dbc, const char *name, int seconds);
+
+void db_unlock(DbContext *dbc, const char *name);
+
+#endif
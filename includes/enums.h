@@ -41,6 +41,15 @@ enum RoomState
 	RoomState_AIBusy = 2,
 };
 
+enum AIJobStatus
+{
+	AIJobStatus_Unknown = 0,
+	AIJobStatus_Queued = 1,
+	AIJobStatus_Running = 2,
+	AIJobStatus_Done = 3,
+	AIJobStatus_Failed = 4,
+};
+
 enum MessageType
 {
 	MessageType_Unknown,
@@ -53,6 +62,7 @@ enum MessageStatus
 {
 	MessageStatus_Unknown = 0,
 	MessageStatus_Sent = 1,
+	MessageStatus_Writing = 2, // content still being added
 };
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef _HTTP_AUDIT_H_
+#define _HTTP_AUDIT_H_
+
+#include <db_context.h>
+
+/* Start the writer of the HttpRequests table for this server process. */
+errno_t http_audit_init(apr_pool_t *pool);
+
+/* Queue the record of an outgoing HTTP request, to be stored in the background.
+ * The strings are copied. Records are dropped if the writer falls behind. */
+void audit_http_request(const char *url, const char *messageId, int duration, int statusCode,
+	const char *requestContent, const char *responseHeaders, const char *responseContent);
+
+#endif
@@ -18,17 +18,34 @@ typedef struct Message
 	const char *content;
 } Message;
 
+/* A message id is 16 bytes, as 32 hex digits outside the database */
+#define MESSAGE_ID_LENGTH 32
+
+/* Check that the id is well formed, before it goes to the database. */
+bool is_message_id(const char *id);
+
 errno_t add_message(DbContext *dbc, Message m, char id[GUID_STORE]);
 
+/* Add the messages of a room, all at once for the readers.
+ * Their ids are given in ids if not NULL, and a zero dateSent
+ * is set to the time stored. */
+errno_t add_messages(DbContext *dbc, Message *messages, int count, char (*ids)[GUID_STORE]);
+
+/* Replace the content of a message, such as one being written. */
+errno_t update_message_content(DbContext *dbc, int roomId, const char *id, const char *content, enum MessageStatus status);
+
 errno_t update_room_state(DbContext *dbc, int roomId, enum RoomState state);
 
-struct send_to_ai
-{
-	AppBackup app_backup;
-	char messageId[GUID_STORE];
-	int roomId;
-};
-errno_t send_message_to_ai(struct send_to_ai *data);
+/* Create the cache of the AI prompt files. */
+errno_t ai_init(apr_pool_t *pool);
+
+/* Reply as AI to the message, adding the messages to the room.
+ * Return EIO if the reply is an error message instead. */
+errno_t chat_with_ai(DbContext *dbc, int roomId, const char *messageId);
+
+/* Used by text_to_speech_stream() when not given */
+#define TTS_MODEL "tts-1"
+#define TTS_VOICE "alloy"
 
 struct tts_input
 {
@@ -36,14 +53,15 @@ struct tts_input
 	const char *voice;
 	const char *input;
 
-	DbContext *dbc; // must not be NULL
 	const char *messageId; // can be NULL
 };
-struct tts_output
-{
-	Charray content;
-	char content_type[GUID_STORE];
-};
-errno_t text_to_speech(struct tts_output *out, struct tts_input info, Charray *buffer);
+
+/* Given each piece of the speech, return false to stop it. */
+typedef bool (*tts_piece_callback)(void *context, const char *data, size_t size);
+
+/* Make the speech (audio/mpeg) of the text, giving it in order as it
+ * arrives, so it never needs to be all in memory. A long text is made
+ * in chunks at the same time. Return ECANCELED if stopped. */
+errno_t text_to_speech_stream(struct tts_input info, tts_piece_callback on_piece, void *context, Charray *buffer);
 
 #endif
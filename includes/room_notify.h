@@ -0,0 +1,31 @@
+#ifndef _ROOM_NOTIFY_H_
+#define _ROOM_NOTIFY_H_
+
+#include <db_context.h>
+
+#define ROOM_VERSION_STORE 24
+
+/* Map the room versions table shared by all server processes. */
+errno_t room_notify_init(apr_pool_t *pool);
+
+/* Get the version of the room, as an opaque string.
+ * It is empty if the table could not be mapped. */
+void get_room_version(int roomId, char version[ROOM_VERSION_STORE]);
+
+/* Mark the room as changed, waking up all its waiters. */
+void notify_room_change(int roomId);
+
+/* Get the version of the room info, such as its state and
+ * members, which changes less often than the room.
+ * Return false if the table could not be mapped. */
+bool get_room_info_version(int roomId, unsigned *version);
+
+/* Mark the room info as changed, for the caches to drop it. */
+void notify_room_info_change(int roomId);
+
+/* Wait for the room version to differ from the one given, as changed
+ * by any server process. Return false only if the timeout was reached.
+ * Give back the database connection first, as it can take long. */
+bool wait_room_change(int roomId, const char *version, int seconds);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _SENDERS_H_
+#define _SENDERS_H_
+
+#include <db_context.h>
+
+#define SENDER_NAME_STORE 64
+
+typedef struct Sender
+{
+	row_id_t sessionId; // a FK to Sessions(Id)
+	row_id_t userId; // 0 if not found
+	char name[SENDER_NAME_STORE]; // as shown to the room members
+} Sender;
+
+/* Create the per-process cache of the message senders. */
+errno_t senders_init(apr_pool_t *pool);
+
+/* Fill the senders of the sessionIds given, from the cache,
+ * else from the database in one query for all those missing. */
+errno_t get_senders(DbContext *dbc, Sender *senders, int count);
+
+#endif
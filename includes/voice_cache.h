@@ -0,0 +1,28 @@
+#ifndef _VOICE_CACHE_H_
+#define _VOICE_CACHE_H_
+
+#include <db_context.h>
+#include "message.h"
+
+/* The hex SHA-256 of the model, voice and text of a speech */
+#define VOICE_KEY_LENGTH 64
+
+/* Make the key of the speech, the same for the same words however spaced.
+ * Return EIO, with the key empty, if the words could not be hashed. */
+errno_t voice_key(char key[VOICE_KEY_LENGTH + 1], struct tts_input info);
+
+/* Find the file of the speech if made before, else return ENOENT. */
+errno_t find_voice_file(DbContext *dbc, const char *key, row_id_t *fileId, char path[FILE_PATH_STORE]);
+
+/* Remember the file of the speech, for the next one with the same words. */
+errno_t add_voice_file(DbContext *dbc, const char *key, row_id_t fileId);
+
+/* Wait while the speech is being made by another request, of any
+ * server process, so that it is made only once. Return ETIMEDOUT
+ * after the seconds given, or ENOTSUP if locks cannot be held.
+ * Else unlock_voice() must follow. */
+errno_t lock_voice(DbContext *dbc, const char *key, int seconds);
+
+void unlock_voice(DbContext *dbc, const char *key);
+
+#endif
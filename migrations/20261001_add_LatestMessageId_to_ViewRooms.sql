@@ -0,0 +1,21 @@
+CREATE OR REPLACE VIEW ViewRooms AS
+SELECT
+	r.Id,
+	r.GroupId,
+	r.Name as RoomName,
+	g.Name as GroupName,
+	g.About as GroupAbout,
+	g.Status as GroupStatus,
+	g.JoinKey,
+	r.State as RoomState,
+	m.DateSent as LatestDateSent,
+	IF(m.DateDeleted IS NULL, LEFT(m.Content, 128), NULL) AS LatestMessage,
+	HEX(r.LatestMessageId) as LatestMessageId,
+	HEX(r.SkippedMessageId) as SkippedMessageId,
+	logo.Path as GroupLogo,
+	banner.Path as GroupBanner
+FROM Rooms as r
+JOIN `Groups` as g on r.GroupId = g.Id
+LEFT JOIN Messages as m on m.Id = r.LatestMessageId
+LEFT JOIN FilePaths as logo on logo.Id = g.LogoImageId
+LEFT JOIN FilePaths as banner on banner.Id = g.BannerImageId;
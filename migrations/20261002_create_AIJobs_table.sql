@@ -0,0 +1,14 @@
+CREATE TABLE AIJobs (
+	Id BIGINT PRIMARY KEY AUTO_INCREMENT,
+	RoomId BIGINT NOT NULL,
+	MessageId BINARY(16) NOT NULL, -- the message to reply to
+	Status INT NOT NULL DEFAULT 1, -- Unknown, Queued, Running, Done, Failed
+	WorkerId VARCHAR(63) NULL,
+	DateQueued TIMESTAMP(6) DEFAULT CURRENT_TIMESTAMP(6),
+	DateStarted TIMESTAMP(6) NULL,
+	DateFinished TIMESTAMP(6) NULL,
+	INDEX IX_AIJobs_Status_RoomId (Status, RoomId),
+	INDEX IX_AIJobs_WorkerId (WorkerId),
+	FOREIGN KEY (RoomId) REFERENCES Rooms(Id) ON DELETE CASCADE,
+	FOREIGN KEY (MessageId) REFERENCES Messages(Id) ON DELETE CASCADE
+);
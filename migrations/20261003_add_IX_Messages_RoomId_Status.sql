@@ -0,0 +1,2 @@
+-- to find the messages still being written
+CREATE INDEX IX_Messages_RoomId_Status ON Messages (RoomId, Status);
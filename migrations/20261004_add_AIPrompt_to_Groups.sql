@@ -0,0 +1,2 @@
+-- if set, used instead of ai/developer_prompt.txt
+ALTER TABLE `Groups` ADD COLUMN AIPrompt TEXT NULL;
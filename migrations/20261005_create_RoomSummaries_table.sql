@@ -0,0 +1,8 @@
+CREATE TABLE RoomSummaries (
+	RoomId BIGINT PRIMARY KEY,
+	FromDateSent TIMESTAMP(6) NULL, -- of the message hidden from AI, when made
+	LastDateSent TIMESTAMP(6) NOT NULL, -- of the last message summarized
+	Content TEXT NOT NULL,
+	DateUpdated TIMESTAMP(6) DEFAULT CURRENT_TIMESTAMP(6),
+	FOREIGN KEY (RoomId) REFERENCES Rooms(Id) ON DELETE CASCADE
+);
@@ -0,0 +1,4 @@
+ALTER TABLE Rooms
+	ADD COLUMN AIResponseId VARCHAR(127) NULL, -- of the AI conversation to continue
+	ADD COLUMN AIChainDateSent TIMESTAMP(6) NULL, -- of the latest message sent in it
+	ADD COLUMN AIChainTokens INT NOT NULL DEFAULT 0;
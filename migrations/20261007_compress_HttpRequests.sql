@@ -0,0 +1,5 @@
+-- new rows store the contents as COMPRESS() blobs, read with UNCOMPRESS()
+ALTER TABLE HttpRequests
+	ADD COLUMN RequestCompressed LONGBLOB NULL,
+	ADD COLUMN ResponseCompressed LONGBLOB NULL,
+	ADD INDEX IX_HttpRequests_DateStored (DateStored);
@@ -0,0 +1,7 @@
+-- keep Rooms.LatestMessageId in the same statement as the insert.
+-- The ids start with the room then the time sent, so they compare
+-- in order, and a message sent earlier does not take the place.
+CREATE TRIGGER TR_Messages_LatestMessageId AFTER INSERT ON Messages
+FOR EACH ROW
+	UPDATE Rooms SET LatestMessageId = NEW.Id
+	WHERE Id = NEW.RoomId AND (LatestMessageId IS NULL OR LatestMessageId < NEW.Id);
@@ -0,0 +1,6 @@
+CREATE TABLE VoiceFiles (
+	Hash BINARY(32) PRIMARY KEY, -- SHA-256 of the model, voice and text spoken
+	FileId BIGINT NOT NULL,
+	DateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+	FOREIGN KEY (FileId) REFERENCES Files(Id) ON DELETE CASCADE
+);
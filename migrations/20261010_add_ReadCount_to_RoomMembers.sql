@@ -0,0 +1,3 @@
+ALTER TABLE RoomMembers
+	ADD COLUMN LastReadMessageId BINARY(16) NULL,
+	ADD COLUMN ReadCount INT NOT NULL DEFAULT 0; -- Rooms.MessageCount up to LastReadMessageId
@@ -0,0 +1,3 @@
+-- the messages shown in the room, kept by TR_Messages_MessageCount
+-- and by delete_message(), so that the unread ones need no counting
+ALTER TABLE Rooms ADD COLUMN MessageCount INT NOT NULL DEFAULT 0;
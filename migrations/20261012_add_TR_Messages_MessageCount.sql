@@ -0,0 +1,6 @@
+-- one row updated per message, whatever the number of members.
+-- Tool calls (Type 2) are not shown, so are not counted.
+CREATE TRIGGER TR_Messages_MessageCount AFTER INSERT ON Messages
+FOR EACH ROW FOLLOWS TR_Messages_LatestMessageId
+	UPDATE Rooms SET MessageCount = MessageCount + 1
+	WHERE Id = NEW.RoomId AND NEW.Type != 2;
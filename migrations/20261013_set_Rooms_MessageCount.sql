@@ -0,0 +1,4 @@
+-- after the trigger, so that no message sent meanwhile is missed
+UPDATE Rooms AS r SET MessageCount = (
+	SELECT COUNT(*) FROM Messages AS m
+	WHERE m.RoomId = r.Id AND m.Type != 2 AND m.DateDeleted IS NULL);
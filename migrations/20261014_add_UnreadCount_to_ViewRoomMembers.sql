@@ -0,0 +1,14 @@
+-- a room never read has no count, rather than its whole history
+CREATE OR REPLACE VIEW ViewRoomMembers AS
+SELECT
+	r.Id as RoomId,
+	gm.MemberId,
+	gm.Status as MemberStatus,
+	rm.DateMuted,
+	rm.DatePinned,
+	HEX(rm.LastReadMessageId) as LastReadMessageId,
+	IF(gm.Status = 1 AND rm.LastReadMessageId IS NOT NULL,
+		GREATEST(r.MessageCount - rm.ReadCount, 0), 0) as UnreadCount
+FROM Rooms as r
+JOIN GroupMembers as gm on gm.GroupId = r.GroupId
+LEFT JOIN RoomMembers as rm on rm.RoomId = r.Id and rm.MemberId = gm.MemberId;
@@ -7,6 +7,20 @@ import { tl } from 'i18n';
 
 const optionsButtonSvgElem = createSVGElement(svgStrings.optionsButton);
 
+const MessageStatus = { Sent: 1, Writing: 2 };
+
+// Give the messages their sender, which comes once per response
+function setSenders(content) {
+	const senders = content.senders;
+	if (!senders) return;
+
+	content.messages.forEach(message => {
+		Object.assign(message, senders[message.sender]);
+		delete message.sender;
+	});
+	delete content.senders;
+}
+
 function deletedMessage(message) {
 	return !message || !message.content;
 }
@@ -54,10 +68,18 @@ class PageInfo {
 		// Fetch messages from the API
 		this.fetching = false;
 		this.isonline = true; // Assume online initially
-		this.timerId = 0;
+		this.stopped = false;
+		this.abort = null; // to cancel a waiting fetch
+		this.source = null; // the stream of room changes
 
 		this.lastMessageDateSent = '';
 		this.latestMsgDate = '';
+		this.lastReadId = ''; // of the last message marked as read
+
+		// older messages, loaded on scrolling up
+		this.oldestDateSent = '';
+		this.hasOlder = false;
+		this.fetchingOlder = false;
 	}
 
 	// Auto-scroll the chat container to the bottom
@@ -83,10 +105,14 @@ class PageInfo {
 				this.cancelReply();
 
 				// Fetch the new message immediately
-				this.fetchMessages();
+				if (!this.source)
+					this.fetchMessages();
 
 				return response.json().then(info => {
-					if (info.ai_is_busy) {
+					if (info.ai_is_queued) {
+						toast("AI will reply after the earlier requests");
+					}
+					else if (info.ai_is_busy) {
 						toast("AI is busy responding, please wait");
 					}
 				});
@@ -202,14 +228,29 @@ class PageInfo {
 		updateElement(this.pageFooter, { content });
 	}
 
-	async fetchMessages() {
-		if (this.fetching) return;
+	// Fetch new messages, optionally waiting on the server for them
+	async fetchMessages(wait, more) {
+		if (this.fetching) return true;
 		this.fetching = true;
 
+		const after = this.lastMessageDateSent;
 		let url = "/api/room/messages?" + this.search;
-		url += "&lastMessageDateSent=" + this.lastMessageDateSent;
+		url += "&lastMessageDateSent=" + after;
 
-		const response = await _fetch(url);
+		const options = {};
+		if (this.room.version && !more) {
+			url += `&r=${this.room.id}&v=${this.room.version}&wait=${wait || 0}`;
+			this.abort = new AbortController();
+			options.signal = this.abort.signal;
+		}
+
+		const response = await _fetch(url, options);
+		this.abort = null;
+
+		if (this.stopped) {
+			this.fetching = false;
+			return false;
+		}
 
 		if (!response.status) {
 			if (this.isonline) {
@@ -217,23 +258,114 @@ class PageInfo {
 				showProblemDetail(response);
 			}
 			this.fetching = false;
-			return;
+			return false;
 		}
 		this.isonline = true;
 
 		if (!response.ok) {
 			showProblemDetail(response);
 			this.fetching = false;
-			return;
+			return false;
+		}
+
+		if (response.status == 204) { // no change
+			this.fetching = false;
+			return true;
 		}
 
 		// process the successful response
 		const content = await response.json();
+		setSenders(content);
 
 		store.putMessages(content);
 		this.setMessages(content);
 
 		this.fetching = false;
+
+		// the rest of the new messages, without waiting
+		if (after && content.hasMore && this.lastMessageDateSent != after)
+			return this.fetchMessages(0, true);
+		return true;
+	}
+
+	// Fetch the page of messages sent before the oldest one shown
+	async fetchOlderMessages() {
+		if (!this.hasOlder || this.fetchingOlder) return;
+		this.fetchingOlder = true;
+
+		let url = "/api/room/messages?" + this.search;
+		url += "&before=" + this.oldestDateSent;
+
+		const response = await _fetch(url);
+
+		if (this.stopped) return;
+
+		if (!response.ok) {
+			if (response.status) showProblemDetail(response);
+			this.fetchingOlder = false;
+			return;
+		}
+
+		const content = await response.json();
+		setSenders(content);
+		this.hasOlder = content.hasMore;
+
+		store.putOlderMessages(content);
+		this.prependMessages(content.messages);
+
+		this.fetchingOlder = false;
+	}
+
+	// Keep fetching messages, each time waiting for a change
+	async pollMessages() {
+		while (!this.stopped) {
+			const waits = Boolean(this.room.version);
+			if (!await this.fetchMessages(25) || !waits)
+				await new Promise(resolve => setTimeout(resolve, 4000));
+		}
+	}
+
+	// Get the room changes as pushed by the server
+	openStream() {
+		let url = "/api/room/stream?" + this.search;
+		url += "&lastMessageDateSent=" + this.lastMessageDateSent;
+
+		const source = new EventSource(url);
+		this.source = source;
+
+		source.addEventListener("messages", (e) => {
+			const after = this.lastMessageDateSent;
+			const content = JSON.parse(e.data);
+			setSenders(content);
+			store.putMessages(content);
+			this.setMessages(content);
+
+			// the rest of what was missed
+			if (after && content.hasMore)
+				this.fetchMessages(0, true);
+		});
+		source.addEventListener("message", (e) => {
+			const content = JSON.parse(e.data);
+			content.roomInfo = this.room;
+			setSenders(content);
+			store.putMessages(content);
+			this.setMessages(content);
+		});
+		source.addEventListener("delete", (e) => {
+			this.removeMessage(JSON.parse(e.data).id);
+		});
+		source.addEventListener("room", (e) => {
+			const room = JSON.parse(e.data);
+			this.room.state = room.state;
+			this.changeSkippedMessage(room.skippedMessageId);
+		});
+		source.addEventListener("error", () => {
+			// the server refused, so fall back to fetching
+			if (source.readyState == EventSource.CLOSED && !this.stopped) {
+				this.source = null;
+				this.pollMessages();
+			}
+		});
 	}
 
 	setMessages(content) {
@@ -244,30 +376,105 @@ class PageInfo {
 			this.room = room;
 			this.titleElem.textContent = room.name;
 			this.setPageFooter();
+			this.hasOlder = Boolean(content.hasMore);
 		}
+		this.room.version = room.version;
 
 		if (content.messages.length > 0) {
+			// a message still being written is fetched again until finished
+			let held = false;
+
+			if (!this.oldestDateSent)
+				this.oldestDateSent = content.messages[0].dateSent;
+
 			content.messages.forEach(message => {
+				if (message.status == MessageStatus.Writing)
+					held = true;
+				else if (!held && this.lastMessageDateSent < message.dateSent)
+					this.lastMessageDateSent = message.dateSent;
+
+				const existing = this.messagesMap[message.id];
+				if (existing) {
+					if (deletedMessage(message))
+						this.removeMessage(message.id);
+					else if (existing.content != message.content)
+						this.updateMessageContent(message);
+					return; // already got
+				}
+
 				// Store message
 				this.messagesMap[message.id] = message;
 				this.appendMessage(message);
-
-				if (this.lastMessageDateSent < message.dateSent) {
-					this.lastMessageDateSent = message.dateSent;
-				}
 			});
 
 			if (firstTime)
 				this.scrollToBottom();
+
+			this.markRead(content.messages);
 		}
 
 		// below comes after as messages must be added to the DOM first
 		this.changeSkippedMessage(room.skippedMessageId, firstTime);
 	}
 
+	// Tell the server the messages shown were read, for the unread counts
+	markRead(messages) {
+		const last = messages[messages.length - 1];
+		if (document.hidden || last.id == this.lastReadId)
+			return;
+		this.lastReadId = last.id;
+		_fetch("/api/message/mark-read?id=" + last.id, { method: "PATCH" });
+	}
+
+	// Insert older messages above those shown, keeping the view in place
+	prependMessages(messages) {
+		messages = messages.filter(message => !this.messagesMap[message.id]);
+		if (messages.length == 0) return;
+
+		const container = this.chatContainer;
+		const height = container.scrollHeight;
+		const shown = Array.from(container.childNodes);
+		const latestMsgDate = this.latestMsgDate;
+
+		container.textContent = "";
+		this.latestMsgDate = '';
+
+		messages.forEach(message => {
+			this.messagesMap[message.id] = message;
+			this.appendMessage(message);
+		});
+		this.oldestDateSent = messages[0].dateSent;
+
+		// the date of the first message shown may now be repeated
+		const first = shown[0];
+		if (first && first.classList.contains("date-separator")
+			&& first.textContent == this.latestMsgDate)
+			shown.shift();
+
+		container.append(...shown);
+		this.latestMsgDate = latestMsgDate;
+		container.scrollTop += container.scrollHeight - height;
+
+		this.changeSkippedMessage(this.room.skippedMessageId, true);
+	}
+
+	updateMessageContent(message) {
+		this.messagesMap[message.id] = message;
+		const elem = document.getElementById(message.id);
+		const content = elem && elem.querySelector(".content");
+		if (content) {
+			content.textContent = "";
+			convertMarkdownText(content, message.content, true);
+		}
+	}
+
 	initPage() {
 		this.page.addEventListener("page-left", () => {
-			clearInterval(this.timerId);
+			this.stopped = true;
+			if (this.abort)
+				this.abort.abort();
+			if (this.source)
+				this.source.close();
 			this.cancelAudio();
 		});
 
@@ -285,7 +492,13 @@ class PageInfo {
 			},
 			{
 				tag: "div", class: "page-content",
-				callback: (elem) => this.chatContainer = elem
+				callback: (elem) => this.chatContainer = elem,
+				events: {
+					"scroll": (e) => {
+						if (e.target.scrollTop < 100)
+							this.fetchOlderMessages();
+					}
+				}
 			},
 			{
 				tag: "div", class: "page-footer",
@@ -304,7 +517,10 @@ class PageInfo {
 			else
 				return this.fetchMessages();
 		}).then(() => {
-			this.timerId = setInterval(this.fetchMessages.bind(this), 4000);
+			if (window.EventSource)
+				this.openStream();
+			else
+				this.pollMessages();
 			if (wasHidden) indicator.hidden = true;
 		});
 	}
@@ -370,13 +586,26 @@ class PageInfo {
 	onReadAloud(e) {
 		const busy = newBusyToast();
 		const message = this.getMessageFromEvent(e);
-		const url = "/api/message/read-aloud?id=" + message.id;
-		_fetch(url).then((response) => {
+		const audio = this.readAloudElem.querySelector("audio");
+
+		// the voice plays while it is being made
+		const done = new AbortController();
+		const events = { once: true, signal: done.signal };
+		audio.addEventListener("playing", () => {
+			done.abort();
 			removeToast(busy);
-			if (response.ok)
-				return response.json().then(this.playAudio.bind(this));
-			else showProblemDetail(response);
-		});
+		}, events);
+		audio.addEventListener("error", () => {
+			done.abort();
+			removeToast(busy);
+			toast("Failed to read aloud");
+		}, events);
+		audio.addEventListener("abort", () => {
+			done.abort();
+			removeToast(busy);
+		}, events);
+
+		this.playAudio({ url: "/api/message/voice?id=" + message.id });
 	}
 
 	onDeleteMessage(e) {
@@ -384,16 +613,23 @@ class PageInfo {
 		if (confirm(tl("Please confirm you want to delete"))) {
 			const url = "/api/message/delete?id=" + message.id;
 			_fetch(url, { method: "DELETE" }).then((response) => {
-				if (response.ok) {
-					const elem = document.getElementById(message.id);
-					elem.remove();
-					message.content = null;
-				}
+				if (response.ok)
+					this.removeMessage(message.id);
 				else showProblemDetail(response);
 			});
 		}
 	}
 
+	removeMessage(id) {
+		const elem = document.getElementById(id);
+		if (elem)
+			elem.remove();
+
+		const message = this.messagesMap[id];
+		if (message)
+			message.content = null;
+	}
+
 	changeSkippedMessage(messageId, firstTime) {
 		let id = this.room.skippedMessageId;
 		if (id == messageId && !firstTime)
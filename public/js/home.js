@@ -19,6 +19,11 @@ function getRoomUI(info) {
 		!info.latestMessage ? { tag: "i", text: "(deleted message)" } :
 		{ text: info.latestMessage };
 
+	const unread = info.unreadCount > 0 ? [{
+		tag: "span", class: "unread-count",
+		text: info.unreadCount > 99 ? "99+" : String(info.unreadCount)
+	}] : [];
+
 	const avatar = info.logo ?
 		{ tag: "img", class: "avatar", alt: "profile", src: info.logo }
 		: {
@@ -37,7 +42,8 @@ function getRoomUI(info) {
 						{ tag: "h5", class: "room-name", html: name },
 						{ tag: "p", class: "latest-message", content: [latest] }
 					]
-				}
+				},
+				...unread
 			]
 		}
 	];
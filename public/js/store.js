@@ -29,6 +29,14 @@ class DataStore {
 			});
 		}
 	}
+
+	putOlderMessages(content) {
+		const data = this.#messages[content.roomInfo.id];
+		if (data != undefined) {
+			data.messages.unshift(...content.messages);
+			data.hasMore = content.hasMore;
+		}
+	}
 }
 
 const store = new DataStore();
@@ -1,5 +1,11 @@
+#include <ctype.h>
+#include <apr_file_info.h>
+#include <apr_thread_mutex.h>
+#include <curl/curl.h>
 #include <http_fetch.h>
 #include "../includes/message.h"
+#include "../includes/db_pool.h"
+#include "../includes/http_audit.h"
 
 static JsonObject *get_message(const char *role, const char *content)
 {
@@ -29,10 +35,43 @@ static JsonObject *call_tool(JsonObject *tool)
 	return r;
 }
 
-static bool process_ai_response(const char *response, JsonArray *messages, DbContext *dbc, Message m)
+/* The AI conversation kept by the provider, which a request can continue */
+struct ai_chain
+{
+	char responseId[128]; // of the latest response, empty if none
+	char lastDateSent[DATE_STORE]; // of the latest room message sent in it
+	int totalTokens; // of the latest response, as reported
+};
+
+/* Clear the AI conversation of the room, for the next request to send the full history */
+static void clear_ai_chain(DbContext *dbc, int roomId)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql = "UPDATE Rooms SET AIResponseId = NULL WHERE Id = ?";
+	JsonValue argv[1];
+	argv[query.argc++] = json_new_int(roomId, false);
+	sql_exec(&query, argv);
+}
+
+static void save_ai_chain(DbContext *dbc, int roomId, const struct ai_chain *chain)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql = "UPDATE Rooms SET AIResponseId = ?, AIChainDateSent = ?, AIChainTokens = ? WHERE Id = ?";
+	JsonValue argv[4];
+	argv[query.argc++] = json_new_str(chain->responseId, false);
+	argv[query.argc++] = json_new_str(chain->lastDateSent, false);
+	argv[query.argc++] = json_new_int(chain->totalTokens, false);
+	argv[query.argc++] = json_new_int(roomId, false);
+	sql_exec(&query, argv);
+}
+
+/* Add the tool calls of the response to the room, its text having been
+ * added while streamed, and set the payload for sending the tool outputs. */
+static bool process_ai_response(const char *response, JsonObject *payload, DbContext *dbc, Message m, struct ai_chain *chain)
 {
 	JsonObject *response_json = cJSON_Parse(response);
 	JsonArray *output = json_get_node(response_json, "output");
+	chain->responseId[0] = '\0';
 
 	if (output == NULL)
 	{
@@ -49,28 +88,53 @@ static bool process_ai_response(const char *response, JsonArray *messages, DbCon
 		char *usage_str = cJSON_Print(usage);
 		APP_LOG(LOG_INFO, "AI tokens usage: %s", usage_str);
 		cJSON_free(usage_str);
+		chain->totalTokens = (int)json_get_number(usage, "total_tokens");
+	}
+
+	CLEAR_ERRNO;
+	JsonArray *messages = NULL;
+	const char *responseId = json_get_string(response_json, "id");
+
+	if (!str_empty(responseId) && strlen(responseId) < sizeof(chain->responseId))
+	{
+		// the next request sends only what comes after the response
+		str_copy(chain->responseId, sizeof(chain->responseId), responseId);
+		cJSON_DeleteItemFromObject(payload, "previous_response_id");
+		json_put_string(payload, "previous_response_id", responseId, 0);
+
+		cJSON_DeleteItemFromObject(payload, "input");
+		messages = json_new_array();
+		json_put_node(payload, "input", messages, 0);
 	}
+	else messages = json_get_node(payload, "input");
 
 	assert(m.id == NULL);
 	bool send_to_ai_again = false;
 
+	// the tool calls are added in one go once complete, at most one
+	// per output item, then freed
+	int size = cJSON_GetArraySize(output) + 1;
+	Message *batch = calloc((size_t)size, sizeof(Message));
+	char **owned = calloc((size_t)size, sizeof(char *));
+	int count = 0, ownedCount = 0;
+
+	if (batch == NULL || owned == NULL)
+	{
+		free(batch);
+		free(owned);
+		cJSON_Delete(response_json);
+		APP_LOG(LOG_ERROR, "Out of memory for the AI response");
+		return false;
+	}
+
 	for (JsonObject *message = output->child; message != NULL; message = message->next)
 	{
 		CLEAR_ERRNO;
 		const char *type = json_get_string(message, "type");
 
-		JsonObject *duplicate = cJSON_Duplicate(message, true);
-		json_array_add(messages, duplicate);
-
-		JsonArray *choices = json_get_node(message, "content");
-		JsonObject *choice = choices == NULL ? NULL : choices->child;
-		const char *text = json_get_string(choice, "text");
-		if (text != NULL)
-		{
-			m.content = text;
-			m.type = MessageType_Normal;
-			add_message(dbc, m, NULL);
-		}
+		JsonObject *duplicate = NULL;
+		if (str_empty(chain->responseId)) // else already known by the AI
+			json_array_add(messages, cJSON_Duplicate(message, true));
 
 		if (str_equal(type, "function_call"))
 		{
@@ -86,57 +150,475 @@ static bool process_ai_response(const char *response, JsonArray *messages, DbCon
 			json_put_string(duplicate, "output", output, 0);
 
 			char *content = cJSON_Print(duplicate);
-			m.content = content;
-			m.type = MessageType_ToolCall;
-			add_message(dbc, m, NULL);
-
-			cJSON_free(content);
+			if (content != NULL)
+			{
+				m.content = content;
+				m.type = MessageType_ToolCall;
+				batch[count++] = m;
+				owned[ownedCount++] = content;
+			}
 			cJSON_Delete(duplicate);
 		}
 	}
 
+	add_messages(dbc, batch, count, NULL);
+
+	for (int i = 0; i < ownedCount; i++)
+		cJSON_free(owned[i]);
+	free(owned);
+	free(batch);
+
 	cJSON_Delete(response_json);
 	return send_to_ai_again;
 }
 
-/* store the HTTP request in the database */
-static void store_http_request(HttpFetch *fetch, const char *request_content, const HttpResponse *response, DbContext *dbc, const char *messageId)
+/* store the HTTP request in the database, in the background */
+static void store_http_request(HttpFetch *fetch, const char *request_content, const HttpResponse *response, const char *messageId)
 {
-	DbQuery query = {.dbc = dbc};
+	audit_http_request(fetch->url, messageId, response->duration, response->status_code,
+		request_content, response->headers.data, response->content.data);
+}
 
-	query.sql =
-		"INSERT INTO HttpRequests (\n"
-		"\tMessageId,\n"
-		"\tURL,\n"
-		"\tDuration,\n"
-		"\tStatusCode,\n"
-		"\tRequestContent,\n"
-		"\tResponseHeaders,\n"
-		"\tResponseContent)\n"
-		"VALUES (UNHEX(?), ?, ?, ?, ?, ?, ?);\n";
-
-	JsonNode argv[8];
-	argv[query.argc++] = json_new_str(messageId, true);
-	argv[query.argc++] = json_new_str(fetch->url, false);
-	argv[query.argc++] = json_new_int(response->duration, false);
-	argv[query.argc++] = json_new_int(response->status_code, false);
-	argv[query.argc++] = json_new_str(request_content, true);
-	argv[query.argc++] = json_new_str(response->headers.data, true);
-	argv[query.argc++] = json_new_str(response->content.data, true);
+/* How often the AI message being written is updated */
+#define STREAM_UPDATE_US (250 * 1000)
 
-	sql_exec(&query, argv);
+/* Text of growing size, for the AI reply being streamed */
+typedef struct TextBuffer
+{
+	char *data;
+	size_t length;
+	size_t size;
+} TextBuffer;
+
+static bool text_append(TextBuffer *t, const char *s, size_t n)
+{
+	if (t->length + n + 1 > t->size)
+	{
+		size_t size = (t->length + n + 1) * 2;
+		char *data = realloc(t->data, size);
+		if (data == NULL)
+			return false;
+		t->data = data;
+		t->size = size;
+	}
+	memcpy(t->data + t->length, s, n);
+	t->length += n;
+	t->data[t->length] = '\0';
+	return true;
+}
+
+struct ai_stream
+{
+	DbContext *dbc;
+	Message m;
+	char id[GUID_STORE]; // of the message being written, else empty
+	time_us_t lastUpdate;
+	TextBuffer text; // of the message being written
+	TextBuffer line; // received but not yet parsed
+	TextBuffer raw; // all received, to be stored
+	char *completed; // the final response, to be freed
+};
+
+static void stream_cleanup(struct ai_stream *s)
+{
+	free(s->text.data);
+	free(s->line.data);
+	free(s->raw.data);
+	cJSON_free(s->completed);
+}
+
+/* Add the text received so far to the message, at most every STREAM_UPDATE_US */
+static void write_stream_text(struct ai_stream *s, bool finished)
+{
+	if (s->text.length == 0)
+		return;
+
+	time_us_t now = time_us();
+	enum MessageStatus status = finished ? MessageStatus_Sent : MessageStatus_Writing;
+
+	if (str_empty(s->id))
+	{
+		Message m = s->m;
+		m.content = s->text.data;
+		m.type = MessageType_Normal;
+		m.status = status;
+		add_message(s->dbc, m, s->id);
+	}
+	else if (finished || now - s->lastUpdate >= STREAM_UPDATE_US)
+		update_message_content(s->dbc, s->m.roomId, s->id, s->text.data, status);
+	else return;
+
+	s->lastUpdate = now;
+	if (finished) // next text is another message
+	{
+		s->id[0] = '\0';
+		s->text.length = 0;
+	}
+}
+
+static void on_stream_event(struct ai_stream *s, const char *data)
+{
+	JsonObject *event = cJSON_Parse(data);
+	const char *type = json_get_string(event, "type");
+
+	if (str_equal(type, "response.output_text.delta"))
+	{
+		const char *delta = json_get_string(event, "delta");
+		if (delta != NULL && text_append(&s->text, delta, strlen(delta)))
+			write_stream_text(s, false);
+	}
+	else if (str_equal(type, "response.output_text.done"))
+	{
+		write_stream_text(s, true);
+	}
+	else if (str_equal(type, "response.completed"))
+	{
+		cJSON_free(s->completed);
+		s->completed = cJSON_PrintUnformatted(json_get_node(event, "response"));
+	}
+
+	cJSON_Delete(event);
+	errno = 0;
+}
+
+/* Called by curl with the next part of the SSE stream */
+static size_t on_stream_data(char *data, size_t size, size_t count, void *context)
+{
+	struct ai_stream *s = (struct ai_stream *)context;
+	size_t length = size * count;
+
+	if (!text_append(&s->raw, data, length) || !text_append(&s->line, data, length))
+		return 0; // aborts the transfer
+
+	char *start = s->line.data, *end;
+	while ((end = memchr(start, '\n', s->line.length - (size_t)(start - s->line.data))) != NULL)
+	{
+		*end = '\0';
+		if (end > start && end[-1] == '\r')
+			end[-1] = '\0';
+
+		// the event type is also given inside the data
+		if (strncmp(start, "data:", 5) == 0)
+			on_stream_event(s, start[5] == ' ' ? start + 6 : start + 5);
+
+		start = end + 1;
+	}
+
+	// keep the incomplete line for the next call
+	s->line.length -= (size_t)(start - s->line.data);
+	memmove(s->line.data, start, s->line.length + 1);
+	return length;
 }
 
-static errno_t skippedDateSent_callback(void *context, int argc, char **argv, char **columns)
+/* The headers of a request described by the HttpFetch, for sending it
+ * with curl when the response is wanted as it comes, which libweb does
+ * not give. To be freed with curl_slist_free_all(). */
+static struct curl_slist *new_request_headers(const HttpFetch *fetch, const char *api_key, const char *accept, Charray *buffer)
 {
-	CHECK_SQL_CALLBACK(1);
-	str_copy((char *)context, DATE_STORE, argv[0]);
+	bprintf(buffer, "Content-Type: %s", fetch->content_type);
+	struct curl_slist *headers = curl_slist_append(NULL, buffer->data);
+
+	if (accept != NULL)
+	{
+		bprintf(buffer, "Accept: %s", accept);
+		headers = curl_slist_append(headers, buffer->data);
+	}
+
+	bprintf(buffer, "Authorization: Bearer %s", api_key);
+	return curl_slist_append(headers, buffer->data);
+}
+
+/* A curl request described by the HttpFetch, its url and timeout,
+ * giving the response to on_data as it comes. NULL if out of memory. */
+static CURL *new_request(const HttpFetch *fetch, struct curl_slist *headers, const char *request_content,
+	curl_write_callback on_data, void *context)
+{
+	CURL *curl = curl_easy_init();
+	if (curl == NULL)
+		return NULL;
+
+	curl_easy_setopt(curl, CURLOPT_URL, fetch->url);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request_content);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, context);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)fetch->response_timeout);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // as called by a thread
+	return curl;
+}
+
+/* If the request failed, tell why in buffer, and log what was sent */
+static bool request_failed(const char *name, CURLcode code, long status_code, const char *request_content, Charray *buffer)
+{
+	if (code != CURLE_OK)
+		bprintf(buffer, "%s request failed: %s", name, curl_easy_strerror(code));
+	else if (status_code != 200)
+		bprintf(buffer, "%s request failed with status %ld", name, status_code);
+	else return false;
+
+	APP_LOG(LOG_DEBUG, "request_content: %s", request_content);
+	return true;
+}
+
+/* Send the request, adding the reply text to the room as it comes.
+ * Return 0 if answered with 200, else the error is in buffer. */
+static errno_t stream_ai_request(struct ai_stream *s, const HttpFetch *fetch, const char *api_key,
+	const char *request_content, long *status_code, Charray *buffer)
+{
+	struct curl_slist *headers = new_request_headers(fetch, api_key, "text/event-stream", buffer);
+	CURL *curl = new_request(fetch, headers, request_content, on_stream_data, s);
+	if (curl == NULL)
+	{
+		curl_slist_free_all(headers);
+		bprintf(buffer, "curl_easy_init() failed");
+		return ENOMEM;
+	}
+
+	CURLcode code = curl_easy_perform(curl);
+	if (code == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, status_code);
+
+	// keep what was received, if the stream was cut
+	write_stream_text(s, true);
+
+	curl_slist_free_all(headers);
+	curl_easy_cleanup(curl);
+	return request_failed("AI", code, *status_code, request_content, buffer) ? EIO : 0;
+}
+
+/* How often the prompt files are checked for changes */
+#define PROMPT_CHECK_US (2 * 1000 * 1000)
+
+/* The prompt files as last loaded, shared by all AI calls of the process */
+static struct
+{
+	apr_pool_t *pool;
+	apr_thread_mutex_t *mutex;
+	JsonObject *payload; // of prompt.json
+	char *developer; // of developer_prompt.txt
+	apr_time_t payloadTime; // modification time when loaded
+	apr_time_t developerTime;
+	time_us_t lastCheck;
+} prompt;
+
+errno_t ai_init(apr_pool_t *pool)
+{
+	if (apr_pool_create(&prompt.pool, pool) != APR_SUCCESS ||
+		apr_thread_mutex_create(&prompt.mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to initialise the AI prompt cache");
+		return EIO;
+	}
 	return 0;
 }
 
+/* Return true if the file was modified since mtime, then update mtime */
+static bool file_changed(const char *filename, apr_time_t *mtime)
+{
+	apr_finfo_t finfo;
+	if (apr_stat(&finfo, filename, APR_FINFO_MTIME, prompt.pool) != APR_SUCCESS)
+		return true; // for the error to be reported when reading it
+
+	if (finfo.mtime == *mtime)
+		return false;
+
+	*mtime = finfo.mtime;
+	return true;
+}
+
+/* Read the file as a string, to be freed */
+static char *read_text_file(const char *filename)
+{
+	char *text = NULL;
+	Charray file = new_char_array("prompt_file");
+
+	if (file.ext->read_file(&file, filename) == 0)
+	{
+		text = malloc(file.length + 1);
+		if (text != NULL)
+		{
+			memcpy(text, file.data, file.length);
+			text[file.length] = '\0';
+		}
+	}
+	charray_free(&file);
+	return text;
+}
+
+/* Load the prompt files that changed. On failure the previous ones are kept. */
+static void reload_prompt(const char *cwd)
+{
+	char filename[256];
+	sprintf(filename, "%s/ai/prompt.json", cwd);
+
+	if (file_changed(filename, &prompt.payloadTime))
+	{
+		char *text = read_text_file(filename);
+		JsonObject *payload = text == NULL ? NULL : cJSON_Parse(text);
+		free(text);
+
+		if (payload == NULL)
+		{
+			APP_LOG(LOG_ERROR, "Failed to load %s", filename);
+			prompt.payloadTime = 0; // to try again
+		}
+		else
+		{
+			cJSON_Delete(prompt.payload);
+			prompt.payload = payload;
+		}
+	}
+
+	sprintf(filename, "%s/ai/developer_prompt.txt", cwd);
+
+	if (file_changed(filename, &prompt.developerTime))
+	{
+		char *text = read_text_file(filename);
+		if (text == NULL)
+		{
+			APP_LOG(LOG_ERROR, "Failed to load %s", filename);
+			prompt.developerTime = 0; // to try again
+		}
+		else
+		{
+			free(prompt.developer);
+			prompt.developer = text;
+		}
+	}
+}
+
+/* Get a copy of prompt.json, with the developer prompt added to its input.
+ * The one of the group, if given, is used instead of developer_prompt.txt. */
+static JsonObject *get_prompt(const char *cwd, const char *group_prompt, bool add_developer, const char **error)
+{
+	if (prompt.mutex == NULL)
+	{
+		*error = "The AI prompt cache is not initialised";
+		return NULL;
+	}
+
+	apr_thread_mutex_lock(prompt.mutex);
+
+	time_us_t now = time_us();
+	if (prompt.payload == NULL || prompt.developer == NULL || now - prompt.lastCheck > PROMPT_CHECK_US)
+	{
+		prompt.lastCheck = now;
+		reload_prompt(cwd);
+	}
+
+	const char *developer = str_empty(group_prompt) ? prompt.developer : group_prompt;
+	JsonObject *payload = NULL;
+
+	if (prompt.payload == NULL)
+		*error = "Failed to read prompt.json file";
+
+	else if (developer == NULL)
+		*error = "Failed to read developer_prompt.txt file";
+
+	else
+	{
+		payload = cJSON_Duplicate(prompt.payload, true);
+		if (add_developer)
+			json_array_add(json_get_node(payload, "input"), get_message("developer", developer));
+	}
+
+	apr_thread_mutex_unlock(prompt.mutex);
+	return payload;
+}
+
+struct room_prompt
+{
+	bool skipped; // if some messages are hidden from AI
+	char skippedDateSent[DATE_STORE];
+	char *group_prompt; // to be freed
+	char *summary; // to be freed
+	char summaryDateSent[DATE_STORE]; // of the last message summarized
+	struct ai_chain chain;
+};
+
+static char *copy_text(const char *text)
+{
+	if (str_empty(text))
+		return NULL;
+
+	size_t length = strlen(text);
+	char *copy = malloc(length + 1);
+	if (copy != NULL)
+		memcpy(copy, text, length + 1);
+	return copy;
+}
+
+static errno_t room_prompt_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(7);
+	struct room_prompt *info = (struct room_prompt *)context;
+
+	if (!str_empty(argv[0]))
+	{
+		info->skipped = true;
+		str_copy(info->skippedDateSent, DATE_STORE, argv[0]);
+	}
+
+	info->group_prompt = copy_text(argv[1]);
+	info->summary = copy_text(argv[2]);
+
+	if (info->summary != NULL)
+		str_copy(info->summaryDateSent, DATE_STORE, argv[3]);
+
+	if (!str_empty(argv[4]) && !str_empty(argv[5]))
+	{
+		str_copy(info->chain.responseId, sizeof(info->chain.responseId), argv[4]);
+		str_copy(info->chain.lastDateSent, DATE_STORE, argv[5]);
+		info->chain.totalTokens = str_to_int(argv[6]);
+	}
+	return 0;
+}
+
+/* Estimated tokens of the room history sent to the AI, unless set by AI_CONTEXT_TOKENS */
+#define CONTEXT_TOKENS 8000
+
+/* Latest messages looked at for the history, and for a summary step */
+#define CONTEXT_MESSAGES "500"
+
+/* The summary is extended once the messages left out reach this */
+#define SUMMARY_STEP_TOKENS 2000
+
+static const char *summary_prompt =
+	"Update the summary of the chat room conversation with the new messages given. "
+	"Keep the names, facts, decisions and open questions that may matter later. "
+	"Reply with only the updated summary, in at most 400 words.";
+
+/* About 4 characters per token, plus the overhead of a message */
+static int estimate_tokens(const char *text)
+{
+	return (int)(strlen(text) / 4) + 4;
+}
+
+struct history
+{
+	JsonArray *messages; // newest first
+	int budget; // tokens left
+	bool truncated; // if older messages were left out
+	char oldestDateSent[DATE_STORE]; // of the messages kept
+	char newestDateSent[DATE_STORE];
+};
+
 static errno_t messages_callback(void *context, int argc, char **argv, char **columns)
 {
 	CHECK_SQL_CALLBACK(6);
+	struct history *history = (struct history *)context;
+
+	// the latest message is always kept, being the one to reply to
+	int tokens = estimate_tokens(argv[5]);
+	if (history->truncated || (tokens > history->budget && history->messages->child != NULL))
+	{
+		history->truncated = true; // so also the older ones
+		return 0;
+	}
+	history->budget -= tokens;
+	str_copy(history->oldestDateSent, DATE_STORE, argv[3]);
+	if (str_empty(history->newestDateSent))
+		str_copy(history->newestDateSent, DATE_STORE, argv[3]);
 
 	int userId = str_to_int(argv[2]);
 	const char *role = userId == 1 ? "assistant" : "user";
@@ -144,11 +626,178 @@ static errno_t messages_callback(void *context, int argc, char **argv, char **co
 	JsonObject *msg = get_message(role, argv[5]);
 	// json_put_string(msg, "name", argv[2], 0);
 
-	json_array_add((JsonArray *)context, msg);
+	json_array_add(history->messages, msg);
+	return 0;
+}
+
+/* Add to the input the latest messages that fit, oldest first.
+ * If chained, only those of users, as the AI ones are known by it. */
+static errno_t load_history(DbContext *dbc, int roomId, const char *sinceDateSent, bool chained, struct history *history, JsonArray *input)
+{
+	history->messages = json_new_array();
+
+	DbQuery query = {.dbc = dbc};
+	query.callback = messages_callback;
+	query.callback_context = history;
+	query.sql = chained
+		? "select Id, ParentId, UserId, DateSent, Status, Content\n"
+		  "from ViewMessages where Content is not null and RoomId = ?\n"
+		  "and DateSent > ? and UserId != 1\n"
+		  "order by RoomId desc, DateSent desc\n"
+		  "limit " CONTEXT_MESSAGES "\n"
+		: "select Id, ParentId, UserId, DateSent, Status, Content\n"
+		  "from ViewMessages where Content is not null and RoomId = ?\n"
+		  "and DateSent > ?\n"
+		  "order by RoomId desc, DateSent desc\n"
+		  "limit " CONTEXT_MESSAGES "\n";
+
+	JsonValue argv[2];
+	argv[query.argc++] = json_new_int(roomId, false);
+	argv[query.argc++] = json_new_str(sinceDateSent, false);
+
+	errno_t e = sql_exec(&query, argv);
+	if (e == 0)
+	{
+		for (int i = cJSON_GetArraySize(history->messages) - 1; i >= 0; i--)
+			json_array_add(input, cJSON_DetachItemFromArray(history->messages, i));
+	}
+	cJSON_Delete(history->messages);
+	history->messages = NULL;
+	return e;
+}
+
+struct summary_input
+{
+	TextBuffer text;
+	int tokens;
+	char lastDateSent[DATE_STORE];
+};
+
+static errno_t summary_input_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(3);
+	struct summary_input *input = (struct summary_input *)context;
+
+	const char *role = str_to_int(argv[0]) == 1 ? "assistant" : "user";
+	if (text_append(&input->text, role, strlen(role)) &&
+		text_append(&input->text, ": ", 2) &&
+		text_append(&input->text, argv[2], strlen(argv[2])) &&
+		text_append(&input->text, "\n\n", 2))
+	{
+		input->tokens += estimate_tokens(argv[2]);
+		str_copy(input->lastDateSent, DATE_STORE, argv[1]);
+	}
 	return 0;
 }
 
-static void chat_with_ai(DbContext *dbc, int roomId, const char *messageId)
+/* Get the text of the first message in the AI response, to be freed */
+static char *get_response_text(const char *response)
+{
+	char *text = NULL;
+	JsonObject *response_json = cJSON_Parse(response);
+	JsonArray *output = json_get_node(response_json, "output");
+
+	for (JsonObject *item = output == NULL ? NULL : output->child; item != NULL; item = item->next)
+	{
+		JsonArray *choices = json_get_node(item, "content");
+		const char *s = json_get_string(choices == NULL ? NULL : choices->child, "text");
+		if (s != NULL)
+		{
+			size_t length = strlen(s);
+			text = malloc(length + 1);
+			if (text != NULL)
+				memcpy(text, s, length + 1);
+			break;
+		}
+	}
+	cJSON_Delete(response_json);
+	errno = 0;
+	return text;
+}
+
+/* Add the messages left out of the AI context to the room summary.
+ * fromDateSent: the hide-from-AI cutoff that the summary is for.
+ * sinceDateSent: the end of the current summary, else the cutoff.
+ * untilDateSent: the oldest message that was sent to the AI. */
+static void update_room_summary(DbContext *dbc, HttpFetch *fetch, int roomId, const char *messageId,
+	const char *model, const char *summary, const char *fromDateSent, const char *sinceDateSent, const char *untilDateSent)
+{
+	struct summary_input input = {0};
+
+	DbQuery query = {.dbc = dbc};
+	query.callback = summary_input_callback;
+	query.callback_context = &input;
+	query.sql =
+		"select UserId, DateSent, Content\n"
+		"from ViewMessages where Content is not null and RoomId = ?\n"
+		"and DateSent > ? and DateSent < ?\n"
+		"order by RoomId, DateSent\n"
+		"limit " CONTEXT_MESSAGES "\n";
+
+	JsonValue argv[5];
+	argv[query.argc++] = json_new_int(roomId, false);
+	argv[query.argc++] = json_new_str(sinceDateSent, false);
+	argv[query.argc++] = json_new_str(untilDateSent, false);
+
+	if (sql_exec(&query, argv) != 0 || input.tokens < SUMMARY_STEP_TOKENS)
+	{
+		free(input.text.data);
+		return; // not worth a request yet
+	}
+
+	JsonObject *payload = json_new_object();
+	json_put_string(payload, "model", model, 0);
+
+	JsonArray *messages = json_new_array();
+	json_array_add(messages, get_message("developer", summary_prompt));
+	if (!str_empty(summary))
+		json_array_add(messages, get_message("user", summary));
+	json_array_add(messages, get_message("user", input.text.data));
+	json_put_node(payload, "input", messages, 0);
+
+	char *request_content = cJSON_Print(payload);
+	cJSON_Delete(payload);
+	free(input.text.data);
+
+	HttpResponse response = {.content = new_char_array("ai_summary")};
+	char _buffer[256];
+	Charray buffer = buffer_to_char_array(_buffer, sizeof(_buffer));
+
+	char *text = NULL;
+	if (request_content != NULL)
+	{
+		send_http_request(fetch, NS(request_content), &response, &buffer);
+		store_http_request(fetch, request_content, &response, messageId);
+
+		if (response.status_code == 200)
+			text = get_response_text(response.content.data);
+	}
+
+	if (text != NULL)
+	{
+		query.callback = NULL;
+		query.sql =
+			"insert into RoomSummaries (RoomId, FromDateSent, LastDateSent, Content)\n"
+			"values (?, ?, ?, ?) on duplicate key update\n"
+			"FromDateSent = values(FromDateSent), LastDateSent = values(LastDateSent),\n"
+			"Content = values(Content), DateUpdated = CURRENT_TIMESTAMP(6)\n";
+
+		query.argc = 1; // keep the roomId
+		argv[query.argc++] = json_new_str(fromDateSent, true);
+		argv[query.argc++] = json_new_str(input.lastDateSent, false);
+		argv[query.argc++] = json_new_str(text, false);
+
+		sql_exec(&query, argv);
+		APP_LOG(LOG_INFO, "Updated the summary of room %d", roomId);
+	}
+	else APP_LOG(LOG_WARNING, "Failed to summarize room %d", roomId);
+
+	free(text);
+	cJSON_free(request_content);
+	http_response_cleanup(&response);
+}
+
+errno_t chat_with_ai(DbContext *dbc, int roomId, const char *messageId)
 {
 	CHECK_ERRNO;
 
@@ -159,9 +808,11 @@ static void chat_with_ai(DbContext *dbc, int roomId, const char *messageId)
 	char _buffer[2048];
 	Charray buffer = buffer_to_char_array(_buffer, sizeof(_buffer));
 
-	HttpResponse response = {.content = new_char_array("ai_response")};
 	JsonObject *payload = NULL; // declare before the first goto
 
+	struct room_prompt info = {0};
+	str_copy(info.skippedDateSent, DATE_STORE, "1970-01-01 00:00:00");
+
 	HttpFetch fetch = {
 		.method = "POST",
 		.content_type = "application/json",
@@ -185,67 +836,79 @@ static void chat_with_ai(DbContext *dbc, int roomId, const char *messageId)
 	bprintf(&buffer, "Authorization: Bearer %s", api_key);
 	add_request_header_v2(&fetch, _buffer);
 
-	struct App *app = get_app();
-	const char *cwd = str_empty(app->cwd) ? "." : app->cwd;
+	DbQuery query = {.dbc = dbc};
+	query.callback = room_prompt_callback;
+	query.callback_context = &info;
+	// the summary is only valid for the same hide-from-AI cutoff
+	query.sql =
+		"select m.DateSent, g.AIPrompt, s.Content, s.LastDateSent,\n"
+		"r.AIResponseId, r.AIChainDateSent, r.AIChainTokens from Rooms as r\n"
+		"join `Groups` as g on g.Id = r.GroupId\n"
+		"left join Messages as m on r.SkippedMessageId = m.Id\n"
+		"left join RoomSummaries as s on s.RoomId = r.Id and s.FromDateSent <=> m.DateSent\n"
+		"where r.Id = ?\n";
 
-	char filename[256];
-	sprintf(filename, "%s/ai/prompt.json", cwd);
+	JsonValue argv[4];
+	argv[query.argc++] = json_new_int(roomId, false);
 
-	if (buffer.ext->read_file(&buffer, filename) != 0)
+	if (sql_exec(&query, argv) != 0)
 	{
-		m.content = "Failed to read prompt.json file";
+		m.content = tl("Internal error: failed to get data");
 		goto finish;
 	}
 
-	payload = cJSON_Parse(buffer.data);
-	sprintf(filename, "%s/ai/developer_prompt.txt", cwd);
+	const char *setting = get_setting("AI_CONTEXT_TOKENS");
+	int budget = str_empty(setting) ? 0 : str_to_int(setting);
+	if (budget <= 0)
+		budget = CONTEXT_TOKENS;
 
-	if (buffer.ext->read_file(&buffer, filename) != 0)
-	{
-		m.content = "Failed to read developer_prompt.txt file";
+	// continue the AI conversation, unless cleared or grown too long
+	bool chained = !str_empty(info.chain.responseId) && info.chain.totalTokens < 2 * budget;
+
+	struct App *app = get_app();
+	const char *cwd = str_empty(app->cwd) ? "." : app->cwd;
+
+	payload = get_prompt(cwd, info.group_prompt, !chained, &m.content);
+	if (payload == NULL)
 		goto finish;
-	}
 
 	JsonArray *messages = json_get_node(payload, "input");
-	json_array_add(messages, get_message("developer", buffer.data));
-
-	char skippedDateSent[DATE_STORE];
-	str_copy(skippedDateSent, DATE_STORE, "1970-01-01 00:00:00");
 
-	DbQuery query = {.dbc = dbc};
-	query.callback = skippedDateSent_callback;
-	query.callback_context = skippedDateSent;
-	query.sql =
-		"select m.DateSent from Rooms as r\n"
-		"join Messages as m on r.SkippedMessageId = m.Id\n"
-		"where m.RoomId = ?\n";
+	// the reply is shown as it is written, see on_stream_event()
+	json_put_node(payload, "stream", cJSON_CreateBool(true), 0);
 
-	JsonValue argv[4];
-	argv[query.argc++] = json_new_int(roomId, false);
+	struct history history = {.budget = budget};
+	const char *sinceDateSent;
 
-	if (sql_exec(&query, argv) != 0)
+	if (chained)
 	{
-		m.content = tl("Internal error: failed to get data");
-		goto finish;
+		json_put_string(payload, "previous_response_id", info.chain.responseId, 0);
+		sinceDateSent = info.chain.lastDateSent;
 	}
+	else
+	{
+		// the messages after the summary if any
+		sinceDateSent = info.summary != NULL ? info.summaryDateSent : info.skippedDateSent;
 
-	query.callback = messages_callback;
-	query.callback_context = messages;
-	query.sql =
-		"select Id, ParentId, UserId, DateSent, Status, Content\n"
-		"from ViewMessages where Content is not null and RoomId = ?\n"
-		"and DateSent > ?\n"
-		"order by RoomId, DateSent\n";
-
-	// roomId already added before, so just add skippedDateSent
-	argv[query.argc++] = json_new_str(skippedDateSent, false);
+		if (info.summary != NULL)
+		{
+			const char *title = "Summary of the earlier conversation:\n";
+			TextBuffer text = {0};
+			if (text_append(&text, title, strlen(title)) && text_append(&text, info.summary, strlen(info.summary)))
+				json_array_add(messages, get_message("developer", text.data));
+			free(text.data);
+		}
+	}
 
-	if (sql_exec(&query, argv) != 0)
+	if (load_history(dbc, roomId, sinceDateSent, chained, &history, messages) != 0)
 	{
 		m.content = tl("Internal error: failed to get data");
 		goto finish;
 	}
 
+	struct ai_chain chain = {0};
+	str_copy(chain.lastDateSent, DATE_STORE, str_empty(history.newestDateSent) ? sinceDateSent : history.newestDateSent);
+
 	while (true)
 	{
 		char *request_content = cJSON_Print(payload);
@@ -255,140 +918,366 @@ static void chat_with_ai(DbContext *dbc, int roomId, const char *messageId)
 			break;
 		}
 
-		send_http_request(&fetch, NS(request_content), &response, &buffer);
+		struct ai_stream s = {.dbc = dbc, .m = m};
+		time_us_t start = time_us();
+		long status_code = 0;
 
-		if (response.status_code != 200)
-			APP_LOG(LOG_DEBUG, "request_content: %s", request_content);
+		errno_t e = stream_ai_request(&s, &fetch, api_key, request_content, &status_code, &buffer);
 
-		store_http_request(&fetch, request_content, &response, dbc, m.parentId);
+		HttpResponse streamed = {0};
+		streamed.status_code = (int)status_code;
+		streamed.duration = (int)((time_us() - start) / 1000);
+		streamed.content.data = s.raw.data;
+		store_http_request(&fetch, request_content, &streamed, m.parentId);
 
 		cJSON_free(request_content);
 
-		if (response.status_code != 200)
-		{
+		bool again = false;
+		if (e != 0)
 			m.content = _buffer;
-			break;
+		else if (s.completed == NULL)
+		{
+			APP_LOG(LOG_ERROR, "No completed response in the AI stream");
+			m.content = tl("Internal Error: No output in AI response.");
 		}
+		else again = process_ai_response(s.completed, payload, dbc, m, &chain);
 
-		if (!process_ai_response(response.content.data, messages, dbc, m))
+		stream_cleanup(&s);
+		if (!again)
 			break;
 	}
 
+	if (m.content == NULL && !str_empty(chain.responseId))
+		save_ai_chain(dbc, roomId, &chain);
+	else clear_ai_chain(dbc, roomId);
+
+	// after the reply, so as not to delay it
+	if (history.truncated && !chained)
+		update_room_summary(dbc, &fetch, roomId, messageId,
+			json_get_string(payload, "model"), info.summary,
+			info.skipped ? info.skippedDateSent : NULL,
+			sinceDateSent, history.oldestDateSent);
+
 finish:
 	if (m.content != NULL)
 		add_message(dbc, m, NULL);
+	free(info.group_prompt);
+	free(info.summary);
 	cJSON_Delete(payload);
-	http_response_cleanup(&response);
 	http_fetch_cleanup(&fetch);
 	errno = 0;
+	return m.content == NULL ? 0 : EIO; // else the error was the reply
 }
 
-errno_t send_message_to_ai(struct send_to_ai *data)
+/* The JSON request of text_to_speech_stream(), to be freed with cJSON_free() */
+static char *tts_request_content(struct tts_input info)
 {
-	struct App app = {0};
-	if (set_app(&app, SetApp_Init) != 0) // must come first
-		return errno;
+	if (str_empty(info.model))
+		info.model = TTS_MODEL;
 
-	use_app_backup(&data->app_backup, &app); // must come second
+	if (str_empty(info.voice))
+		info.voice = TTS_VOICE;
 
-	DbContext dbc = db_context_init(DBMS_MySQL, NULL);
+	JsonObject *payload = json_new_object();
+	json_put_string(payload, "model", info.model, 0);
+	json_put_string(payload, "voice", info.voice, 0);
+	json_put_string(payload, "input", info.input, 0);
 
-	APP_LOG(LOG_INFO, "AI replying to message %s", data->messageId);
+	char *request_content = cJSON_Print(payload);
+	cJSON_Delete(payload);
+	return request_content;
+}
 
-	chat_with_ai(&dbc, data->roomId, data->messageId);
+#define TTS_URL "https://api.openai.com/v1/audio/speech"
 
-	update_room_state(&dbc, data->roomId, RoomState_Normal);
+/* Characters of text per speech request, well below the limit of the API */
+#define TTS_CHUNK_SIZE 1500
 
-	_free(data, data->app_backup.malloc_tracker); // must come second to last
+/* Fewer for the first chunk, so that it is heard sooner */
+#define TTS_FIRST_CHUNK_SIZE 300
 
-	set_app(NULL, SetApp_Clear); // must come last
-	return 0;
+/* Speech requests made at the same time for one text */
+#define TTS_PARALLEL 3
+
+/* Get where to end the chunk of text, of at most size characters.
+ * Prefer the end of a Markdown block, then of a line, then of a
+ * sentence, then of a word. Each but the last is over size / 2. */
+static size_t speech_chunk_length(const char *text, size_t size)
+{
+	size_t length = 0;
+	while (length <= size && text[length] != '\0')
+		length++;
+
+	if (length <= size)
+		return length;
+
+	size_t block = 0, line = 0, sentence = 0, word = 0;
+	for (size_t i = size / 2; i < size; i++)
+	{
+		char ch = text[i];
+		if (ch == '\n' && text[i + 1] == '\n')
+			block = i + 2;
+		else if (ch == '\n')
+			line = i + 1;
+		else if (ch == ' ' && strchr(".!?", text[i - 1]) != NULL)
+			sentence = i + 1;
+		else if (ch == ' ')
+			word = i + 1;
+	}
+	if (block != 0) return block;
+	if (line != 0) return line;
+	if (sentence != 0) return sentence;
+	if (word != 0) return word;
+
+	// not inside a UTF-8 character
+	size_t end = size;
+	while (end > size / 2 && ((unsigned char)text[end] & 0xC0) == 0x80)
+		end--;
+	return end;
 }
 
-errno_t text_to_speech(struct tts_output *out, struct tts_input info, Charray *buffer)
+struct tts_stream;
+
+/* One request of text_to_speech_stream(), for a chunk of the text */
+struct tts_chunk
 {
-	assert(out != NULL);
-	assert(info.input != NULL);
-	assert(buffer != NULL);
+	struct tts_stream *s;
+	CURL *curl;
+	char *request_content;
+	time_us_t start;
+	long status_code; // known once the first piece arrives
+	bool done;
+	TextBuffer audio; // received before its turn to be given
+	TextBuffer error; // the response if not the audio
+};
+
+/* The speech of text_to_speech_stream(), given in the order of the text */
+struct tts_stream
+{
+	tts_piece_callback on_piece;
+	void *context;
+	struct tts_chunk *next; // the one being given
+	size_t size; // of the audio given
+	bool stopped; // by on_piece
+};
+
+static bool give_audio(struct tts_stream *s, const char *data, size_t size)
+{
+	if (s->stopped || !s->on_piece(s->context, data, size))
+	{
+		s->stopped = true;
+		return false;
+	}
+	s->size += size;
+	return true;
+}
 
-	CHECK_ERRNO errno;
-	JsonObject *payload = NULL; // declare before the first goto
+static size_t on_tts_data(char *data, size_t size, size_t count, void *context)
+{
+	struct tts_chunk *chunk = context;
+	size_t length = size * count;
 
-	HttpResponse response = {
-		.headers = new_char_array("tts_headers"),
-		.content = new_char_array("tts_content"),
-		.get_response_headers = true};
+	if (chunk->status_code == 0)
+		curl_easy_getinfo(chunk->curl, CURLINFO_RESPONSE_CODE, &chunk->status_code);
 
-	HttpFetch fetch = {
-		.url = "https://api.openai.com/v1/audio/speech",
-		.method = "POST",
-		.content_type = "application/json",
-		.response_timeout = 10 * 60};
+	if (chunk->status_code != 200)
+		return text_append(&chunk->error, data, length) ? length : 0;
 
-	const char *api_key = get_setting("AI_API_KEY");
-	if (str_empty(api_key))
+	// only the one being given needs no waiting
+	if (chunk == chunk->s->next)
+		return give_audio(chunk->s, data, length) ? length : 0;
+
+	return text_append(&chunk->audio, data, length) ? length : 0;
+}
+
+/* Give the audio waiting, moving to the next chunk when one is done */
+static void give_waiting_audio(struct tts_stream *s, struct tts_chunk *end)
+{
+	while (s->next < end && !s->stopped)
 	{
-		bprintf(buffer, "AI_API_KEY not found");
-		return EAGAIN;
+		struct tts_chunk *chunk = s->next;
+		if (chunk->audio.length > 0)
+		{
+			give_audio(s, chunk->audio.data, chunk->audio.length);
+			chunk->audio.length = 0;
+		}
+		if (!chunk->done)
+			break;
+		s->next++;
 	}
+}
+
+static bool start_tts_chunk(struct tts_chunk *chunk, CURLM *multi, const HttpFetch *fetch,
+	struct curl_slist *headers, struct tts_input info, const char *text, size_t length)
+{
+	char *input = malloc(length + 1);
+	if (input == NULL)
+		return false;
+
+	memcpy(input, text, length);
+	input[length] = '\0';
 
-	errno_t e = http_fetch_init(&fetch);
-	if (e != 0)
+	info.input = input;
+	chunk->request_content = tts_request_content(info);
+	free(input);
+
+	if (chunk->request_content == NULL)
+		return false;
+
+	chunk->curl = new_request(fetch, headers, chunk->request_content, on_tts_data, chunk);
+	if (chunk->curl == NULL)
+		return false;
+
+	chunk->start = time_us();
+	return curl_multi_add_handle(multi, chunk->curl) == CURLM_OK;
+}
+
+/* Record the request of the chunk and free it, whether done or not */
+static void end_tts_chunk(struct tts_chunk *chunk, CURLM *multi, const char *messageId)
+{
+	if (chunk->curl != NULL)
 	{
-		bprintf(buffer, "http_fetch_init() failed");
-		return e;
+		curl_multi_remove_handle(multi, chunk->curl);
+		curl_easy_cleanup(chunk->curl);
+
+		// the audio is not kept, only what went wrong
+		audit_http_request(TTS_URL, messageId, (int)((time_us() - chunk->start) / 1000), (int)chunk->status_code,
+			chunk->request_content, NULL, chunk->error.data);
 	}
+	cJSON_free(chunk->request_content);
+	free(chunk->audio.data);
+	free(chunk->error.data);
+}
 
-	bprintf(buffer, "Authorization: Bearer %s", api_key);
-	add_request_header_v2(&fetch, buffer->data);
+/* Check the chunks done, return non-zero with the error in buffer if one failed */
+static errno_t check_tts_chunks(CURLM *multi, struct tts_chunk *chunks, int count, Charray *buffer)
+{
+	CURLMsg *msg;
+	int left = 0;
+	while ((msg = curl_multi_info_read(multi, &left)) != NULL)
+	{
+		if (msg->msg != CURLMSG_DONE)
+			continue;
 
-	if (str_empty(info.model))
-		info.model = "tts-1";
+		struct tts_chunk *chunk = chunks;
+		while (chunk < chunks + count && chunk->curl != msg->easy_handle)
+			chunk++;
+		if (chunk == chunks + count)
+			continue;
 
-	if (str_empty(info.voice))
-		info.voice = "alloy";
+		CURLcode code = msg->data.result;
+		if (code == CURLE_OK)
+			curl_easy_getinfo(chunk->curl, CURLINFO_RESPONSE_CODE, &chunk->status_code);
+		chunk->done = true;
 
-	payload = json_new_object();
-	json_put_string(payload, "model", info.model, 0);
-	json_put_string(payload, "voice", info.voice, 0);
-	json_put_string(payload, "input", info.input, 0);
+		if (code == CURLE_WRITE_ERROR && chunk->s->stopped)
+		{
+			bprintf(buffer, "Speech not wanted anymore");
+			return ECANCELED;
+		}
+		if (request_failed("Speech", code, chunk->status_code, chunk->request_content, buffer))
+			return EAGAIN;
+	}
+	return 0;
+}
 
-	char *request_content = cJSON_Print(payload);
-	if (request_content == NULL)
+errno_t text_to_speech_stream(struct tts_input info, tts_piece_callback on_piece, void *context, Charray *buffer)
+{
+	assert(info.input != NULL);
+	assert(on_piece != NULL);
+	assert(buffer != NULL);
+
+	const char *api_key = get_setting("AI_API_KEY");
+	if (str_empty(api_key))
 	{
-		bprintf(buffer, tl("Failed to serialize json payload"));
-		e = errno ? errno : EINVAL;
-		goto finish;
+		bprintf(buffer, "AI_API_KEY not found");
+		return EAGAIN;
 	}
 
-	send_http_request(&fetch, NS(request_content), &response, buffer);
+	// more than enough, as each chunk but the last is over TTS_CHUNK_SIZE / 2
+	int count = (int)(strlen(info.input) / (TTS_CHUNK_SIZE / 4)) + 2;
 
-	if (response.status_code == 200)
+	struct tts_chunk *chunks = calloc((size_t)count, sizeof(struct tts_chunk));
+	CURLM *multi = curl_multi_init();
+	if (chunks == NULL || multi == NULL)
 	{
-		// move response.content to out->content
-		charray_free(&out->content); // avoid memory leaks
-		out->content = response.content; // transfer the char array
-		response.content = new_char_array(NULL); // nullify the char array
+		free(chunks);
+		if (multi != NULL)
+			curl_multi_cleanup(multi);
+		bprintf(buffer, "curl_multi_init() failed");
+		return ENOMEM;
 	}
-	else APP_LOG(LOG_DEBUG, "request_content: %s", request_content);
 
-	store_http_request(&fetch, request_content, &response, info.dbc, info.messageId);
+	// only described, as sent with curl
+	HttpFetch fetch = {
+		.url = TTS_URL,
+		.method = "POST",
+		.content_type = "application/json",
+		.response_timeout = 10 * 60};
 
-	cJSON_free(request_content);
+	struct curl_slist *headers = new_request_headers(&fetch, api_key, NULL, buffer);
+
+	struct tts_stream s = {.on_piece = on_piece, .context = context, .next = chunks};
+	const char *rest = info.input;
+	int started = 0;
+	errno_t e = 0;
 
-	if (response.status_code != 200)
+	while (true)
 	{
-		e = errno ? errno : EAGAIN;
-		goto finish;
+		// start the next chunks, with at most TTS_PARALLEL not yet given
+		while (*rest != '\0' && started < count && started - (int)(s.next - chunks) < TTS_PARALLEL)
+		{
+			while (isspace((unsigned char)*rest))
+				rest++;
+			if (*rest == '\0')
+				break;
+
+			size_t length = speech_chunk_length(rest, started == 0 ? TTS_FIRST_CHUNK_SIZE : TTS_CHUNK_SIZE);
+			struct tts_chunk *chunk = &chunks[started++];
+			chunk->s = &s;
+
+			if (!start_tts_chunk(chunk, multi, &fetch, headers, info, rest, length))
+			{
+				bprintf(buffer, "Failed to start a speech request");
+				e = ENOMEM;
+				break;
+			}
+			rest += length;
+		}
+		if (e != 0)
+			break;
+
+		int running = 0;
+		curl_multi_perform(multi, &running);
+
+		e = check_tts_chunks(multi, chunks, started, buffer);
+		if (e != 0)
+			break;
+
+		// in the order of the text, so the segments make one file
+		give_waiting_audio(&s, chunks + started);
+		if (s.stopped)
+		{
+			bprintf(buffer, "Speech not wanted anymore");
+			e = ECANCELED;
+			break;
+		}
+
+		if (s.next == chunks + started && (*rest == '\0' || started == count))
+			break;
+
+		if (running > 0)
+			curl_multi_poll(multi, NULL, 0, 1000, NULL);
 	}
 
-	APP_LOG(LOG_INFO, "Got a voice file of size %zu.", out->content.length);
+	for (int i = 0; i < started; i++)
+		end_tts_chunk(&chunks[i], multi, info.messageId);
 
-finish:
-	cJSON_Delete(payload);
-	http_response_cleanup(&response);
-	http_fetch_cleanup(&fetch);
-	errno = 0;
+	if (e == 0)
+		APP_LOG(LOG_INFO, "Streamed a voice file of size %zu in %d parts.", s.size, started);
+
+	free(chunks);
+	curl_slist_free_all(headers);
+	curl_multi_cleanup(multi);
 	return e;
 }
-
@@ -0,0 +1,314 @@
+#include <apr_thread_cond.h>
+#include <apr_thread_proc.h>
+#include "../includes/ai_queue.h"
+#include "../includes/db_pool.h"
+#include "../includes/message.h"
+#include "../includes/room_notify.h"
+
+/* How often an idle worker looks for jobs queued by other processes */
+#define IDLE_WAIT_US (5 * 1000 * 1000)
+
+/* A job running for longer is taken to have been abandoned,
+ * for example by a server process that was stopped */
+#define JOB_LEASE "INTERVAL 30 MINUTE"
+
+/* How often abandoned jobs are cleared */
+#define SWEEP_INTERVAL_US (5 * 60 * 1000 * 1000LL)
+
+typedef struct AIJob
+{
+	long long id;
+	int roomId;
+	char messageId[GUID_STORE];
+} AIJob;
+
+static struct
+{
+	apr_thread_mutex_t *mutex;
+	apr_thread_cond_t *cond;
+	unsigned pending; // jobs queued by this process, not yet looked for
+	bool stopping;
+	AppBackup app_backup;
+	char workerIds[AI_WORKERS][32];
+	apr_thread_t *threads[AI_WORKERS];
+	int threadCount;
+} queue;
+
+/* Wait for the workers to end, as they use the database pool and the
+ * queue mutex, which are destroyed by the cleanups registered before */
+static apr_status_t stop_workers(void *data)
+{
+	(void)data;
+	apr_thread_mutex_lock(queue.mutex);
+	queue.stopping = true;
+	apr_thread_cond_broadcast(queue.cond);
+	apr_thread_mutex_unlock(queue.mutex);
+
+	for (int i = 0; i < queue.threadCount; i++)
+	{
+		apr_status_t status;
+		apr_thread_join(&status, queue.threads[i]);
+	}
+	queue.threadCount = 0;
+	return APR_SUCCESS;
+}
+
+static errno_t job_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(3);
+	AIJob *job = (AIJob *)context;
+	job->id = str_to_long(argv[0]);
+	job->roomId = str_to_int(argv[1]);
+	str_copy(job->messageId, GUID_STORE, argv[2]);
+	return 0;
+}
+
+/* Take the oldest queued job of a room where none is running */
+static errno_t claim_job(DbContext *dbc, const char *workerId, AIJob *job)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql =
+		"UPDATE AIJobs AS j\n"
+		"JOIN (\n"
+		"\tSELECT q.Id FROM AIJobs AS q\n"
+		"\tWHERE q.Status = ? AND NOT EXISTS (\n"
+		"\t\tSELECT 1 FROM AIJobs AS r\n"
+		"\t\tWHERE r.RoomId = q.RoomId AND r.Status = ?\n"
+		"\t\tAND r.DateStarted > CURRENT_TIMESTAMP(6) - " JOB_LEASE ")\n"
+		"\tORDER BY q.Id LIMIT 1\n"
+		") AS n ON n.Id = j.Id\n"
+		"SET j.Status = ?, j.WorkerId = ?, j.DateStarted = CURRENT_TIMESTAMP(6)\n"
+		"WHERE j.Status = ?\n"; // if another worker took it meanwhile
+
+	JsonValue argv[5];
+	argv[query.argc++] = json_new_int(AIJobStatus_Queued, false);
+	argv[query.argc++] = json_new_int(AIJobStatus_Running, false);
+	argv[query.argc++] = json_new_int(AIJobStatus_Running, false);
+	argv[query.argc++] = json_new_str(workerId, false);
+	argv[query.argc++] = json_new_int(AIJobStatus_Queued, false);
+
+	errno_t e = sql_exec(&query, argv);
+	if (e != 0)
+		return e;
+
+	// a worker has at most one running job
+	query.callback = job_callback;
+	query.callback_context = job;
+	query.sql = "SELECT Id, RoomId, HEX(MessageId) FROM AIJobs WHERE WorkerId = ? AND Status = ?";
+	query.argc = 0;
+	argv[query.argc++] = json_new_str(workerId, false);
+	argv[query.argc++] = json_new_int(AIJobStatus_Running, false);
+	return sql_exec(&query, argv);
+}
+
+static void finish_job(DbContext *dbc, const AIJob *job, enum AIJobStatus status)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql = "UPDATE AIJobs SET Status = ?, DateFinished = CURRENT_TIMESTAMP(6) WHERE Id = ?";
+
+	JsonValue argv[2];
+	argv[query.argc++] = json_new_int(status, false);
+	argv[query.argc++] = json_new_long(job->id, false);
+
+	if (sql_exec(&query, argv) != 0)
+		APP_LOG(LOG_ERROR, "Failed to finish AI job %lld", job->id);
+
+	// the room stays busy while more replies are queued for it
+	query.sql =
+		"UPDATE Rooms SET State = IF(EXISTS (\n"
+		"\tSELECT 1 FROM AIJobs WHERE RoomId = ? AND Status = ?), ?, ?)\n"
+		"WHERE Id = ?\n";
+	JsonValue args[5];
+	query.argc = 0;
+	args[query.argc++] = json_new_int(job->roomId, false);
+	args[query.argc++] = json_new_int(AIJobStatus_Queued, false);
+	args[query.argc++] = json_new_int(RoomState_AIBusy, false);
+	args[query.argc++] = json_new_int(RoomState_Normal, false);
+	args[query.argc++] = json_new_int(job->roomId, false);
+
+	if (sql_exec(&query, args) == 0)
+	{
+		notify_room_info_change(job->roomId);
+		notify_room_change(job->roomId);
+	}
+}
+
+/* Fail the abandoned jobs, and free the rooms left busy by them */
+static void sweep_jobs(DbContext *dbc)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql =
+		"UPDATE AIJobs SET Status = ?, DateFinished = CURRENT_TIMESTAMP(6)\n"
+		"WHERE Status = ? AND DateStarted < CURRENT_TIMESTAMP(6) - " JOB_LEASE "\n";
+
+	JsonValue argv[4];
+	argv[query.argc++] = json_new_int(AIJobStatus_Failed, false);
+	argv[query.argc++] = json_new_int(AIJobStatus_Running, false);
+
+	if (sql_exec(&query, argv) != 0)
+		return;
+
+	// the reply of the failed job, cut while being written, is kept
+	// as is; not those of the jobs of the room that came after it
+	query.sql =
+		"UPDATE Messages AS m\n"
+		"JOIN AIJobs AS j ON j.RoomId = m.RoomId AND j.MessageId = m.ParentId\n"
+		"SET m.Status = ?\n"
+		"WHERE j.Status = ? AND j.DateFinished > CURRENT_TIMESTAMP(6) - " JOB_LEASE "\n"
+		"AND m.SenderId = 1 AND m.Status = ?\n"; // the AI
+
+	query.argc = 0;
+	argv[query.argc++] = json_new_int(MessageStatus_Sent, false);
+	argv[query.argc++] = json_new_int(AIJobStatus_Failed, false);
+	argv[query.argc++] = json_new_int(MessageStatus_Writing, false);
+	sql_exec(&query, argv);
+
+	query.sql =
+		"UPDATE Rooms AS r SET r.State = ?\n"
+		"WHERE r.State = ? AND NOT EXISTS (\n"
+		"\tSELECT 1 FROM AIJobs AS j WHERE j.RoomId = r.Id AND j.Status IN (?, ?))\n";
+
+	query.argc = 0;
+	argv[query.argc++] = json_new_int(RoomState_Normal, false);
+	argv[query.argc++] = json_new_int(RoomState_AIBusy, false);
+	argv[query.argc++] = json_new_int(AIJobStatus_Queued, false);
+	argv[query.argc++] = json_new_int(AIJobStatus_Running, false);
+	sql_exec(&query, argv);
+}
+
+static void *APR_THREAD_FUNC ai_worker(apr_thread_t *thread, void *data)
+{
+	(void)thread;
+	const char *workerId = (const char *)data;
+
+	struct App app = {0};
+	if (set_app(&app, SetApp_Init) != 0) // must come first
+		return NULL;
+
+	use_app_backup(&queue.app_backup, &app); // must come second
+
+	bool sweeper = workerId == queue.workerIds[0];
+	time_us_t lastSweep = 0;
+
+	while (true)
+	{
+		AIJob job = {0};
+		DbContext dbc;
+		db_pool_acquire(&dbc);
+
+		if (sweeper && time_us() - lastSweep > SWEEP_INTERVAL_US)
+		{
+			sweep_jobs(&dbc);
+			lastSweep = time_us();
+		}
+
+		errno_t e = claim_job(&dbc, workerId, &job);
+		if (e == 0 && job.id != 0)
+		{
+			APP_LOG(LOG_INFO, "AI replying to message %s", job.messageId);
+			errno_t failed = chat_with_ai(&dbc, job.roomId, job.messageId);
+			finish_job(&dbc, &job, failed ? AIJobStatus_Failed : AIJobStatus_Done);
+		}
+		db_pool_release(&dbc, e == 0);
+
+		if (job.id != 0)
+			continue; // there may be more
+
+		apr_thread_mutex_lock(queue.mutex);
+		if (queue.pending == 0 && !queue.stopping)
+			apr_thread_cond_timedwait(queue.cond, queue.mutex, IDLE_WAIT_US);
+		if (queue.pending > 0)
+			queue.pending--;
+		bool stopping = queue.stopping;
+		apr_thread_mutex_unlock(queue.mutex);
+
+		if (stopping)
+			break;
+	}
+
+	set_app(NULL, SetApp_Clear); // must come last
+	return NULL;
+}
+
+errno_t ai_queue_init(apr_pool_t *pool)
+{
+	apr_threadattr_t *attr = NULL;
+	unsigned char token[8];
+
+	errno_t e = ai_init(pool);
+	if (e != 0)
+		return e;
+
+	if (apr_thread_mutex_create(&queue.mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS ||
+		apr_thread_cond_create(&queue.cond, pool) != APR_SUCCESS ||
+		apr_threadattr_create(&attr, pool) != APR_SUCCESS ||
+		apr_generate_random_bytes(token, sizeof(token)) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to initialise the AI queue");
+		return EIO;
+	}
+
+	queue.app_backup.malloc_tracker = "ai_queue";
+	get_app_backup(&queue.app_backup, get_app());
+
+	// after the mutex and the condition, so that it runs before theirs;
+	// a worker giving an AI reply is waited for, which can take minutes
+	apr_pool_cleanup_register(pool, NULL, stop_workers, apr_pool_cleanup_null);
+
+	for (int i = 0; i < AI_WORKERS; i++)
+	{
+		// unique across the servers, to find the job claimed
+		sprintf(queue.workerIds[i], "%02x%02x%02x%02x%02x%02x%02x%02x-%d",
+			token[0], token[1], token[2], token[3],
+			token[4], token[5], token[6], token[7], i);
+
+		if (apr_thread_create(&queue.threads[i], attr, ai_worker, queue.workerIds[i], pool) != APR_SUCCESS)
+		{
+			APP_LOG(LOG_ERROR, "Failed to start AI worker %d", i);
+			return EIO;
+		}
+		queue.threadCount++;
+	}
+	return 0;
+}
+
+errno_t queue_ai_job(DbContext *dbc, int roomId, const char messageId[GUID_STORE])
+{
+	// busy first, in one transaction with the job: a worker freeing
+	// the room meanwhile then waits on its row, and sees the job
+	bool transaction = db_begin(dbc) == 0;
+
+	DbQuery query = {.dbc = dbc};
+	query.sql = "UPDATE Rooms SET State = ? WHERE Id = ?";
+
+	JsonValue argv[2];
+	argv[query.argc++] = json_new_int(RoomState_AIBusy, false);
+	argv[query.argc++] = json_new_int(roomId, false);
+
+	errno_t e = sql_exec(&query, argv);
+	if (e == 0)
+	{
+		query.sql = "INSERT INTO AIJobs (RoomId, MessageId) VALUES (?, UNHEX(?))";
+		query.argc = 0;
+		argv[query.argc++] = json_new_int(roomId, false);
+		argv[query.argc++] = json_new_str(messageId, false);
+		e = sql_exec(&query, argv);
+	}
+
+	if (transaction)
+		e = db_end(dbc, e == 0);
+	if (e != 0)
+		return e;
+
+	notify_room_info_change(roomId);
+	notify_room_change(roomId);
+
+	if (queue.mutex == NULL)
+		return 0; // some other process will do it
+
+	apr_thread_mutex_lock(queue.mutex);
+	queue.pending++;
+	apr_thread_cond_signal(queue.cond);
+	apr_thread_mutex_unlock(queue.mutex);
+	return 0;
+}
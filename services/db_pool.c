@@ -0,0 +1,257 @@
+#include <ap_mpm.h>
+#include <apr_thread_mutex.h>
+#include "../includes/ai_queue.h"
+#include "../includes/db_pool.h"
+
+/* A connection idle for longer than this is pinged before re-use */
+#define IDLE_CHECK_US (30 * 1000000LL)
+
+typedef struct DbSlot
+{
+	DbContext dbc;
+	DbContext *owner; // set while borrowed
+	bool open; // if dbc holds a connection
+	time_us_t lastUsed;
+	bool inTransaction; // see db_begin()
+	int namedLocks; // held by the connection, see db_lock()
+	bool broken; // so closed when given back
+} DbSlot;
+
+static struct
+{
+	apr_thread_mutex_t *mutex;
+	DbSlot *slots;
+	int capacity; // one per worker thread
+} pool;
+
+errno_t db_pool_init(apr_pool_t *p)
+{
+	int threads = 0;
+	ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads);
+	if (threads < 1)
+		threads = 1;
+
+	apr_thread_mutex_t *mutex = NULL;
+	if (apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to create the database pool mutex");
+		return ENOMEM;
+	}
+
+	pool.capacity = threads + AI_WORKERS + 1; // +1 for the audit writer
+	pool.slots = apr_pcalloc(p, (size_t)pool.capacity * sizeof(DbSlot));
+	pool.mutex = mutex; // must come last
+
+	APP_LOG(LOG_INFO, "Database pool created with %d connections", pool.capacity);
+	return 0;
+}
+
+static void close_slot(DbSlot *slot)
+{
+	db_context_cleanup(&slot->dbc);
+	slot->open = false;
+	slot->broken = false;
+	slot->inTransaction = false;
+	slot->namedLocks = 0; // released by the server on close
+}
+
+static bool db_is_alive(DbContext *dbc)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql = "SELECT 1";
+	return sql_exec(&query, NULL) == 0;
+}
+
+static DbSlot *find_slot(const DbContext *dbc)
+{
+	DbSlot *slot = NULL;
+	if (pool.mutex == NULL)
+		return NULL;
+
+	apr_thread_mutex_lock(pool.mutex);
+	for (int i = 0; i < pool.capacity; i++)
+	{
+		if (pool.slots[i].owner == dbc)
+		{
+			slot = &pool.slots[i];
+			break;
+		}
+	}
+	apr_thread_mutex_unlock(pool.mutex);
+	return slot;
+}
+
+void db_pool_acquire(DbContext *dbc)
+{
+	DbSlot *slot = NULL;
+
+	if (pool.mutex != NULL)
+	{
+		apr_thread_mutex_lock(pool.mutex);
+		for (int i = 0; i < pool.capacity; i++)
+		{
+			DbSlot *s = &pool.slots[i];
+			if (s->owner != NULL)
+				continue;
+
+			if (slot == NULL || s->open)
+				slot = s; // prefer an open connection
+
+			if (slot->open)
+				break;
+		}
+		if (slot != NULL)
+			slot->owner = dbc;
+		apr_thread_mutex_unlock(pool.mutex);
+	}
+
+	if (slot == NULL) // if no pool or all are borrowed
+	{
+		*dbc = db_context_init(DBMS_MySQL, NULL);
+		return;
+	}
+
+	if (slot->open && time_us() - slot->lastUsed > IDLE_CHECK_US)
+	{
+		if (!db_is_alive(&slot->dbc))
+		{
+			APP_LOG(LOG_WARNING, "Reconnecting a stale database connection");
+			close_slot(slot);
+		}
+	}
+
+	if (!slot->open)
+	{
+		slot->dbc = db_context_init(DBMS_MySQL, NULL);
+		slot->open = true;
+	}
+	*dbc = slot->dbc;
+}
+
+void db_pool_release(DbContext *dbc, bool healthy)
+{
+	DbSlot *slot = find_slot(dbc);
+
+	if (slot == NULL)
+		db_context_cleanup(dbc);
+	else
+	{
+		slot->dbc = *dbc;
+		slot->lastUsed = time_us();
+
+		if (slot->inTransaction) // left open by mistake
+			db_end(dbc, false);
+
+		if (slot->namedLocks > 0) // left held by mistake
+		{
+			APP_LOG(LOG_ERROR, "Closing a connection holding %d named locks", slot->namedLocks);
+			healthy = false;
+		}
+
+		if (!healthy || slot->broken)
+			close_slot(slot);
+
+		apr_thread_mutex_lock(pool.mutex);
+		slot->owner = NULL;
+		apr_thread_mutex_unlock(pool.mutex);
+	}
+
+	memset(dbc, 0, sizeof(*dbc));
+}
+
+/* Run a statement that changes the state of the connection */
+static errno_t exec_simple(DbContext *dbc, const char *sql)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql = sql;
+	return sql_exec(&query, NULL);
+}
+
+errno_t db_begin(DbContext *dbc)
+{
+	DbSlot *slot = find_slot(dbc);
+	if (slot != NULL && slot->inTransaction)
+		return EALREADY;
+
+	errno_t e = exec_simple(dbc, "START TRANSACTION");
+	if (e != 0)
+	{
+		APP_LOG(LOG_ERROR, "Failed to start a transaction");
+		return e;
+	}
+
+	if (slot != NULL)
+		slot->inTransaction = true;
+	return 0;
+}
+
+errno_t db_end(DbContext *dbc, bool ok)
+{
+	// a connection not from the pool is closed with its transaction
+	DbSlot *slot = find_slot(dbc);
+	if (slot != NULL && !slot->inTransaction)
+		return ok ? 0 : EIO;
+
+	errno_t e = exec_simple(dbc, ok ? "COMMIT" : "ROLLBACK");
+	if (e != 0)
+		APP_LOG(LOG_ERROR, "Failed to end the transaction");
+
+	if (slot != NULL)
+	{
+		slot->inTransaction = false;
+		slot->broken |= e != 0; // the state of the connection is not known
+	}
+	return ok && e == 0 ? 0 : EIO;
+}
+
+static errno_t get_lock_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(1);
+	*(int *)context = str_to_int(argv[0]);
+	return 0;
+}
+
+errno_t db_lock(DbContext *dbc, const char *name, int seconds)
+{
+	int locked = 0;
+	DbQuery query = {.dbc = dbc};
+	query.sql = "SELECT GET_LOCK(?, ?)";
+	query.callback = get_lock_callback;
+	query.callback_context = &locked;
+
+	JsonValue argv[2];
+	argv[query.argc++] = json_new_str(name, false);
+	argv[query.argc++] = json_new_int(seconds, false);
+
+	errno_t e = sql_exec(&query, argv);
+	if (e != 0)
+		return e;
+
+	if (locked != 1)
+		return ETIMEDOUT;
+
+	DbSlot *slot = find_slot(dbc);
+	if (slot != NULL)
+		slot->namedLocks++;
+	return 0;
+}
+
+void db_unlock(DbContext *dbc, const char *name)
+{
+	DbQuery query = {.dbc = dbc};
+	query.sql = "SELECT RELEASE_LOCK(?)";
+
+	JsonValue argv[1];
+	argv[query.argc++] = json_new_str(name, false);
+
+	// else still counted, so that the connection is closed on release
+	if (sql_exec(&query, argv) != 0)
+	{
+		APP_LOG(LOG_ERROR, "Failed to release the lock %s", name);
+		return;
+	}
+
+	DbSlot *slot = find_slot(dbc);
+	if (slot != NULL && slot->namedLocks > 0)
+		slot->namedLocks--;
+}
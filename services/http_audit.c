@@ -0,0 +1,306 @@
+#include <apr_thread_cond.h>
+#include <apr_thread_proc.h>
+#include "../includes/db_pool.h"
+#include "../includes/http_audit.h"
+
+/* Records waiting to be stored, beyond which they are dropped */
+#define QUEUE_SIZE 256
+
+/* How long the writer sleeps when there is nothing to store */
+#define IDLE_WAIT_US (60 * 1000000LL)
+
+/* How often the records older than HTTP_AUDIT_DAYS are deleted */
+#define PURGE_INTERVAL_US (60 * 60 * 1000000LL)
+
+/* Rows deleted per statement, to keep the locks short */
+#define PURGE_BATCH "1000"
+
+/* Batches per purge, the rest is left for the next one */
+#define PURGE_BATCHES 100
+
+/* Held by the process purging, for the others not to at the same time */
+#define PURGE_LOCK __LIB__ "-http-audit-purge"
+
+typedef struct AuditRecord
+{
+	char messageId[GUID_STORE];
+	char *url;
+	int duration;
+	int statusCode;
+	char *requestContent; // NULL if not sampled
+	char *responseHeaders;
+	char *responseContent;
+} AuditRecord;
+
+static struct
+{
+	apr_thread_mutex_t *mutex;
+	apr_thread_cond_t *cond;
+	AuditRecord *records[QUEUE_SIZE]; // ring buffer
+	unsigned head; // next to store
+	unsigned count;
+	unsigned dropped; // since last logged
+	bool stopping;
+	AppBackup app_backup;
+
+	// settings, read once at start
+	int sample; // percent of the successful requests with their bodies
+	int days; // kept for, 0 if forever
+} audit;
+
+static char *copy_string(const char *s)
+{
+	if (s == NULL)
+		return NULL;
+
+	size_t length = strlen(s);
+	char *copy = malloc(length + 1);
+	if (copy != NULL)
+		memcpy(copy, s, length + 1);
+	return copy;
+}
+
+static void free_record(AuditRecord *r)
+{
+	free(r->url);
+	free(r->requestContent);
+	free(r->responseHeaders);
+	free(r->responseContent);
+	free(r);
+}
+
+/* Get the integer setting, or the default if not set */
+static int get_int_setting(const char *name, int default_value)
+{
+	const char *value = get_setting(name);
+	return str_empty(value) ? default_value : str_to_int(value);
+}
+
+static void store_record(DbContext *dbc, const AuditRecord *r)
+{
+	DbQuery query = {.dbc = dbc};
+
+	// compressed by the database, to be read with UNCOMPRESS()
+	query.sql =
+		"INSERT INTO HttpRequests (\n"
+		"\tMessageId,\n"
+		"\tURL,\n"
+		"\tDuration,\n"
+		"\tStatusCode,\n"
+		"\tRequestCompressed,\n"
+		"\tResponseHeaders,\n"
+		"\tResponseCompressed)\n"
+		"VALUES (UNHEX(?), ?, ?, ?, COMPRESS(?), ?, COMPRESS(?));\n";
+
+	JsonNode argv[8];
+	argv[query.argc++] = json_new_str(str_empty(r->messageId) ? NULL : r->messageId, true);
+	argv[query.argc++] = json_new_str(r->url, false);
+	argv[query.argc++] = json_new_int(r->duration, false);
+	argv[query.argc++] = json_new_int(r->statusCode, false);
+	argv[query.argc++] = json_new_str(r->requestContent, true);
+	argv[query.argc++] = json_new_str(r->responseHeaders, true);
+	argv[query.argc++] = json_new_str(r->responseContent, true);
+
+	if (sql_exec(&query, argv) != 0)
+		APP_LOG(LOG_WARNING, "Failed to store the HTTP request to %s", r->url);
+}
+
+static errno_t exists_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(1);
+	*(bool *)context = str_to_int(argv[0]) != 0;
+	return 0;
+}
+
+/* Delete the records older than the retention, a batch at a time.
+ * Only one process does at a time, the others then find none left. */
+static void purge_records(DbContext *dbc)
+{
+	if (audit.days <= 0)
+		return; // kept forever
+
+	errno_t e = db_lock(dbc, PURGE_LOCK, 0);
+	if (e == ETIMEDOUT)
+		return; // being done by another process
+	bool locked = e == 0;
+
+	JsonValue argv[1];
+	argv[0] = json_new_int(audit.days, false);
+
+	for (int i = 0; i < PURGE_BATCHES; i++)
+	{
+		bool more = false;
+		DbQuery query = {.dbc = dbc, .argc = 1};
+		query.callback = exists_callback;
+		query.callback_context = &more;
+		query.sql =
+			"SELECT EXISTS (SELECT 1 FROM HttpRequests\n"
+			"WHERE DateStored < CURRENT_TIMESTAMP(6) - INTERVAL ? DAY)\n";
+
+		if (sql_exec(&query, argv) != 0 || !more)
+			break;
+
+		query.callback = NULL;
+		query.sql =
+			"DELETE FROM HttpRequests\n"
+			"WHERE DateStored < CURRENT_TIMESTAMP(6) - INTERVAL ? DAY\n"
+			"ORDER BY DateStored LIMIT " PURGE_BATCH "\n";
+
+		if (sql_exec(&query, argv) != 0)
+			break;
+	}
+
+	if (locked)
+		db_unlock(dbc, PURGE_LOCK);
+}
+
+static void *APR_THREAD_FUNC audit_writer(apr_thread_t *thread, void *data)
+{
+	(void)thread;
+	(void)data;
+
+	struct App app = {0};
+	if (set_app(&app, SetApp_Init) != 0) // must come first
+		return NULL;
+
+	use_app_backup(&audit.app_backup, &app); // must come second
+
+	time_us_t lastPurge = 0;
+	while (true)
+	{
+		AuditRecord *batch[QUEUE_SIZE];
+		unsigned count = 0, dropped = 0;
+
+		apr_thread_mutex_lock(audit.mutex);
+		if (audit.count == 0 && !audit.stopping)
+			apr_thread_cond_timedwait(audit.cond, audit.mutex, IDLE_WAIT_US);
+
+		// take them all, then store them without holding the lock
+		while (audit.count > 0)
+		{
+			batch[count++] = audit.records[audit.head];
+			audit.head = (audit.head + 1) % QUEUE_SIZE;
+			audit.count--;
+		}
+		dropped = audit.dropped;
+		audit.dropped = 0;
+		bool stopping = audit.stopping;
+		apr_thread_mutex_unlock(audit.mutex);
+
+		if (dropped > 0)
+			APP_LOG(LOG_WARNING, "Dropped %u HTTP request records as the writer fell behind", dropped);
+
+		bool purge = time_us() - lastPurge > PURGE_INTERVAL_US;
+		if (count > 0 || purge)
+		{
+			DbContext dbc;
+			db_pool_acquire(&dbc);
+
+			for (unsigned i = 0; i < count; i++)
+			{
+				store_record(&dbc, batch[i]);
+				free_record(batch[i]);
+			}
+
+			if (purge)
+			{
+				purge_records(&dbc);
+				lastPurge = time_us();
+			}
+			db_pool_release(&dbc, true);
+		}
+
+		if (stopping)
+			break;
+	}
+
+	set_app(NULL, SetApp_Clear); // must come last
+	return NULL;
+}
+
+static apr_status_t stop_writer(void *data)
+{
+	(void)data;
+	apr_thread_mutex_lock(audit.mutex);
+	audit.stopping = true;
+	apr_thread_cond_signal(audit.cond);
+	apr_thread_mutex_unlock(audit.mutex);
+	return APR_SUCCESS;
+}
+
+errno_t http_audit_init(apr_pool_t *pool)
+{
+	apr_threadattr_t *attr = NULL;
+	apr_thread_t *thread = NULL;
+
+	if (apr_thread_mutex_create(&audit.mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS ||
+		apr_thread_cond_create(&audit.cond, pool) != APR_SUCCESS ||
+		apr_threadattr_create(&attr, pool) != APR_SUCCESS ||
+		apr_threadattr_detach_set(attr, 1) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to initialise the HTTP request audit");
+		audit.mutex = NULL;
+		return EIO;
+	}
+
+	audit.sample = get_int_setting("HTTP_AUDIT_SAMPLE", 100);
+	audit.days = get_int_setting("HTTP_AUDIT_DAYS", 30);
+
+	audit.app_backup.malloc_tracker = "http_audit";
+	get_app_backup(&audit.app_backup, get_app());
+
+	apr_pool_cleanup_register(pool, NULL, stop_writer, apr_pool_cleanup_null);
+
+	if (apr_thread_create(&thread, attr, audit_writer, NULL, pool) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to start the HTTP request audit writer");
+		audit.mutex = NULL;
+		return EIO;
+	}
+	return 0;
+}
+
+void audit_http_request(const char *url, const char *messageId, int duration, int statusCode,
+	const char *requestContent, const char *responseHeaders, const char *responseContent)
+{
+	if (audit.mutex == NULL)
+		return;
+
+	// the bodies of the failures are always kept
+	bool success = 200 <= statusCode && statusCode < 300;
+	bool sampled = !success || audit.sample >= 100;
+
+	unsigned char draw[2];
+	if (!sampled && audit.sample > 0 && apr_generate_random_bytes(draw, sizeof(draw)) == APR_SUCCESS)
+		sampled = (draw[0] << 8 | draw[1]) % 100 < audit.sample; // rand() is not thread-safe
+
+	AuditRecord *r = calloc(1, sizeof(AuditRecord));
+	if (r == NULL)
+		return;
+
+	str_copy(r->messageId, GUID_STORE, messageId == NULL ? "" : messageId);
+	r->url = copy_string(url);
+	r->duration = duration;
+	r->statusCode = statusCode;
+	r->responseHeaders = copy_string(responseHeaders);
+
+	if (sampled)
+	{
+		r->requestContent = copy_string(requestContent);
+		r->responseContent = copy_string(responseContent);
+	}
+
+	apr_thread_mutex_lock(audit.mutex);
+	if (audit.count < QUEUE_SIZE)
+	{
+		audit.records[(audit.head + audit.count) % QUEUE_SIZE] = r;
+		audit.count++;
+		r = NULL;
+		apr_thread_cond_signal(audit.cond);
+	}
+	else audit.dropped++;
+	apr_thread_mutex_unlock(audit.mutex);
+
+	if (r != NULL)
+		free_record(r);
+}
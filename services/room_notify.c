@@ -0,0 +1,300 @@
+#define _DEFAULT_SOURCE // for syscall()
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <apr_atomic.h>
+#include <apr_file_io.h>
+#include <apr_mmap.h>
+#include <http_config.h>
+#include "../includes/room_notify.h"
+
+/* In the runtime directory of the server, unless set by ROOM_VERSIONS_FILE,
+ * which sites sharing a server must do. Preferably on a tmpfs. */
+#define TABLE_FILE __LIB__ "-room-versions"
+
+#define ROOM_SLOTS 4096
+
+/* Slots a room can be in, the least recently changed
+ * being given to another room when all are taken */
+#define PROBE_SLOTS 16
+
+typedef struct RoomEntry
+{
+	volatile apr_uint32_t roomId; // 0 if the slot is free
+	volatile apr_uint32_t version;
+} RoomEntry;
+
+/* All zeros is a valid empty table. New fields go at the end. */
+typedef struct RoomTable
+{
+	volatile apr_uint32_t epoch; // set once, tells tables apart
+	apr_uint32_t unused;
+	RoomEntry entries[ROOM_SLOTS];
+	volatile apr_uint32_t infoVersions[ROOM_SLOTS]; // same index as entries
+
+	// every change takes the next version, so none is given twice
+	volatile apr_uint32_t clock;
+	// the version of the rooms not in the table, at least
+	// the highest of those whose slot was given to another
+	volatile apr_uint32_t floor;
+} RoomTable;
+
+static RoomTable *table;
+
+errno_t room_notify_init(apr_pool_t *pool)
+{
+	apr_file_t *file = NULL;
+	apr_finfo_t finfo;
+	apr_mmap_t *mm = NULL;
+
+	// must be the same for all server processes of the site
+	const char *path = get_setting("ROOM_VERSIONS_FILE");
+	if (str_empty(path))
+		path = ap_runtime_dir_relative(pool, TABLE_FILE);
+	if (path == NULL)
+		return EINVAL;
+
+	apr_status_t s = apr_file_open(&file, path,
+		APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_BINARY,
+		APR_FPROT_UREAD | APR_FPROT_UWRITE, pool);
+
+	if (s == APR_SUCCESS)
+		s = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+
+	if (s == APR_SUCCESS && finfo.size < (apr_off_t)sizeof(RoomTable))
+		s = apr_file_trunc(file, sizeof(RoomTable)); // fills with zeros
+
+	if (s == APR_SUCCESS)
+		s = apr_mmap_create(&mm, file, 0, sizeof(RoomTable), APR_MMAP_READ | APR_MMAP_WRITE, pool);
+
+	if (file != NULL)
+		apr_file_close(file); // the mapping stays valid
+
+	if (s != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to map %s, error %d", path, s);
+		return EIO;
+	}
+
+	RoomTable *t = mm->mm;
+	apr_atomic_cas32(&t->epoch, (apr_uint32_t)apr_time_sec(apr_time_now()), 0);
+
+	// a table made before the clock, counted per room
+	if (apr_atomic_read32(&t->clock) == 0)
+	{
+		apr_uint32_t highest = 0;
+		for (int i = 0; i < ROOM_SLOTS; i++)
+		{
+			if (t->entries[i].version > highest)
+				highest = t->entries[i].version;
+			if (t->infoVersions[i] > highest)
+				highest = t->infoVersions[i];
+		}
+		apr_atomic_cas32(&t->clock, highest, 0);
+	}
+	table = t; // must come last
+	return 0;
+}
+
+/* Sleep while the word of the table has the value given, at most the
+ * time given. The futex is not private, so the table being mapped by
+ * all the server processes, any of them can wake it up. */
+static void wait_word(volatile apr_uint32_t *word, apr_uint32_t value, apr_interval_time_t timeout)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)apr_time_sec(timeout);
+	ts.tv_nsec = (long)apr_time_usec(timeout) * 1000;
+	syscall(SYS_futex, (apr_uint32_t *)word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+/* Wake up all those waiting on the word, after changing it */
+static void wake_word(volatile apr_uint32_t *word)
+{
+	syscall(SYS_futex, (apr_uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static apr_uint32_t next_version(void)
+{
+	return apr_atomic_inc32(&table->clock) + 1;
+}
+
+static apr_uint32_t last_change(int slot)
+{
+	apr_uint32_t version = apr_atomic_read32(&table->entries[slot].version);
+	apr_uint32_t info = apr_atomic_read32(&table->infoVersions[slot]);
+	return version > info ? version : info;
+}
+
+static void raise_floor(apr_uint32_t version)
+{
+	apr_uint32_t floor = apr_atomic_read32(&table->floor);
+	while (floor < version)
+	{
+		apr_uint32_t seen = apr_atomic_cas32(&table->floor, version, floor);
+		if (seen == floor)
+			break;
+		floor = seen;
+	}
+}
+
+/* The slot of the room, -1 if not in the table. Lookups never
+ * add to the table, so that rooms are only there once changed. */
+static int find_slot(int roomId)
+{
+	if (table == NULL || roomId <= 0)
+		return -1;
+
+	apr_uint32_t id = (apr_uint32_t)roomId;
+	apr_uint32_t hash = id * 2654435761u;
+
+	for (apr_uint32_t i = 0; i < PROBE_SLOTS; i++)
+	{
+		int slot = (int)((hash + i) % ROOM_SLOTS);
+		apr_uint32_t current = apr_atomic_read32(&table->entries[slot].roomId);
+
+		if (current == id)
+			return slot;
+		if (current == 0) // slots are never freed, so it is not further
+			break;
+	}
+	return -1;
+}
+
+/* The slot of the room, else a free one taken for it, else the one
+ * least recently changed, whose room then has the floor as version.
+ * Return -1 only if other processes keep taking the slots meanwhile. */
+static int take_slot(int roomId)
+{
+	if (table == NULL || roomId <= 0)
+		return -1;
+
+	apr_uint32_t id = (apr_uint32_t)roomId;
+	apr_uint32_t hash = id * 2654435761u;
+
+	for (int attempt = 0; attempt < 4; attempt++)
+	{
+		int oldest = -1;
+		apr_uint32_t oldestId = 0;
+		apr_uint32_t oldestChange = 0;
+
+		for (apr_uint32_t i = 0; i < PROBE_SLOTS; i++)
+		{
+			int slot = (int)((hash + i) % ROOM_SLOTS);
+			apr_uint32_t current = apr_atomic_read32(&table->entries[slot].roomId);
+
+			if (current == 0)
+				current = apr_atomic_cas32(&table->entries[slot].roomId, id, 0);
+
+			if (current == 0 || current == id)
+				return slot;
+
+			apr_uint32_t changed = last_change(slot);
+			if (oldest < 0 || changed < oldestChange)
+			{
+				oldest = slot;
+				oldestId = current;
+				oldestChange = changed;
+			}
+		}
+
+		// before and after its room leaves, as it may change meanwhile
+		raise_floor(oldestChange);
+		if (apr_atomic_cas32(&table->entries[oldest].roomId, id, oldestId) != oldestId)
+			continue;
+		raise_floor(last_change(oldest));
+
+		apr_atomic_set32(&table->entries[oldest].version, next_version());
+		apr_atomic_set32(&table->infoVersions[oldest], next_version());
+
+		// the waiters of the room that left, and of those not in the
+		// table, now have the floor
+		wake_word(&table->entries[oldest].version);
+		wake_word(&table->clock);
+		return oldest;
+	}
+	return -1;
+}
+
+/* Give the slot the next version, unless the room has left it */
+static void set_next_version(volatile apr_uint32_t *version, int slot, int roomId)
+{
+	apr_uint32_t next = next_version();
+	apr_atomic_set32(version, next);
+
+	// then the change is of the rooms not in the table
+	if (apr_atomic_read32(&table->entries[slot].roomId) != (apr_uint32_t)roomId)
+		raise_floor(next);
+}
+
+void get_room_version(int roomId, char version[ROOM_VERSION_STORE])
+{
+	if (table == NULL || roomId <= 0)
+	{
+		version[0] = '\0';
+		return;
+	}
+
+	int slot = find_slot(roomId);
+	apr_uint32_t v = slot < 0 ? apr_atomic_read32(&table->floor) : apr_atomic_read32(&table->entries[slot].version);
+	sprintf(version, "%x.%x", apr_atomic_read32(&table->epoch), v);
+}
+
+void notify_room_change(int roomId)
+{
+	int slot = take_slot(roomId);
+	if (slot < 0)
+		return;
+
+	set_next_version(&table->entries[slot].version, slot, roomId);
+
+	// see wait_room_change()
+	wake_word(&table->entries[slot].version);
+	wake_word(&table->clock);
+}
+
+bool get_room_info_version(int roomId, unsigned *version)
+{
+	if (table == NULL || roomId <= 0)
+		return false;
+
+	int slot = find_slot(roomId);
+	*version = slot < 0 ? apr_atomic_read32(&table->floor) : apr_atomic_read32(&table->infoVersions[slot]);
+	return true;
+}
+
+void notify_room_info_change(int roomId)
+{
+	int slot = take_slot(roomId);
+	if (slot >= 0)
+		set_next_version(&table->infoVersions[slot], slot, roomId);
+}
+
+bool wait_room_change(int roomId, const char *version, int seconds)
+{
+	apr_time_t deadline = apr_time_now() + apr_time_from_sec(seconds);
+
+	while (true)
+	{
+		// the word that changes with the room: its version if in the
+		// table, else the clock, as it may be added to the table, which
+		// is read before the room, so that no change is missed after
+		int slot = find_slot(roomId);
+		volatile apr_uint32_t *word = slot < 0 ? NULL : &table->entries[slot].version;
+		if (word == NULL && table != NULL)
+			word = &table->clock;
+		apr_uint32_t seen = word == NULL ? 0 : apr_atomic_read32(word);
+
+		char current[ROOM_VERSION_STORE];
+		get_room_version(roomId, current);
+
+		if (str_empty(current) || !str_equal(current, version))
+			return true; // changed, or not tracked
+
+		apr_interval_time_t left = deadline - apr_time_now();
+		if (left <= 0)
+			return false;
+
+		wait_word(word, seen, left);
+	}
+}
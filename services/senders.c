@@ -0,0 +1,186 @@
+#include <apr_thread_mutex.h>
+#include "../includes/senders.h"
+
+#define SENDER_CACHE_SIZE 4096
+
+/* Entries per bucket, the least recently used is replaced */
+#define SENDER_CACHE_WAYS 4
+
+/* For a changed user name to be seen eventually */
+#define SENDER_CACHE_US (10 * 60 * 1000000LL)
+
+/* Senders looked up per query, to bound the SQL text */
+#define LOAD_BATCH 100
+
+typedef struct CachedSender
+{
+	Sender sender; // free if sessionId is 0
+	time_us_t dateCached;
+	apr_uint32_t lastUsed;
+} CachedSender;
+
+static struct
+{
+	apr_thread_mutex_t *mutex;
+	CachedSender *entries;
+	apr_uint32_t clock;
+} cache;
+
+errno_t senders_init(apr_pool_t *pool)
+{
+	apr_thread_mutex_t *mutex = NULL;
+
+	if (apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS)
+	{
+		APP_LOG(LOG_ERROR, "Failed to initialise the sender cache");
+		return ENOMEM;
+	}
+
+	cache.entries = apr_pcalloc(pool, SENDER_CACHE_SIZE * sizeof(CachedSender));
+	cache.mutex = mutex; // must come last
+	return 0;
+}
+
+static CachedSender *sender_bucket(row_id_t sessionId)
+{
+	unsigned long long hash = (unsigned long long)sessionId * 11400714819323198485ull;
+	size_t buckets = SENDER_CACHE_SIZE / SENDER_CACHE_WAYS;
+	return &cache.entries[(size_t)(hash >> 32) % buckets * SENDER_CACHE_WAYS];
+}
+
+/* Must be called with the mutex held */
+static bool find_sender(Sender *sender, time_us_t now)
+{
+	CachedSender *bucket = sender_bucket(sender->sessionId);
+	for (int i = 0; i < SENDER_CACHE_WAYS; i++)
+	{
+		CachedSender *entry = &bucket[i];
+		if (entry->sender.sessionId == sender->sessionId && now - entry->dateCached < SENDER_CACHE_US)
+		{
+			*sender = entry->sender;
+			entry->lastUsed = ++cache.clock;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void cache_sender(const Sender *sender, time_us_t now)
+{
+	if (cache.mutex == NULL)
+		return;
+
+	apr_thread_mutex_lock(cache.mutex);
+
+	CachedSender *bucket = sender_bucket(sender->sessionId);
+	CachedSender *entry = &bucket[0];
+	for (int i = 0; i < SENDER_CACHE_WAYS; i++)
+	{
+		if (bucket[i].sender.sessionId == sender->sessionId || bucket[i].sender.sessionId == 0)
+		{
+			entry = &bucket[i];
+			break;
+		}
+		// compared by age, so that the clock can wrap around
+		if (cache.clock - bucket[i].lastUsed > cache.clock - entry->lastUsed)
+			entry = &bucket[i];
+	}
+	entry->sender = *sender;
+	entry->dateCached = now;
+	entry->lastUsed = ++cache.clock;
+
+	apr_thread_mutex_unlock(cache.mutex);
+}
+
+struct load_senders
+{
+	Sender *senders;
+	int count;
+	time_us_t now;
+};
+
+static errno_t load_senders_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(3);
+	struct load_senders *info = (struct load_senders *)context;
+	row_id_t sessionId = atoll(argv[0]);
+
+	for (int i = 0; i < info->count; i++)
+	{
+		Sender *sender = &info->senders[i];
+		if (sender->sessionId != sessionId)
+			continue;
+
+		sender->userId = atoll(argv[1]);
+		if (!str_empty(argv[2]))
+			snprintf(sender->name, sizeof(sender->name), "%s", argv[2]);
+		else
+			snprintf(sender->name, sizeof(sender->name), "ANO-%s", argv[1]);
+
+		cache_sender(sender, info->now);
+	}
+	return 0;
+}
+
+/* Load the senders not found, which have a zero userId */
+static errno_t load_senders(DbContext *dbc, Sender *senders, int count, time_us_t now)
+{
+	char sql[256 + LOAD_BATCH * 24];
+	char *end = sql + sprintf(sql,
+		"select s.Id, s.UserId, u.Name\n"
+		"from Sessions as s\n"
+		"join Users as u on u.Id = s.UserId\n"
+		"where s.Id in (");
+
+	// the ids are numbers, so they can go in the SQL text
+	int n = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (senders[i].userId == 0)
+			end += sprintf(end, n++ == 0 ? "%lld" : ",%lld", (long long)senders[i].sessionId);
+	}
+	if (n == 0)
+		return 0;
+	strcpy(end, ")");
+
+	struct load_senders info = {senders, count, now};
+	DbQuery query = {.dbc = dbc};
+	query.sql = sql;
+	query.callback = load_senders_callback;
+	query.callback_context = &info;
+
+	return sql_exec(&query, NULL);
+}
+
+errno_t get_senders(DbContext *dbc, Sender *senders, int count)
+{
+	time_us_t now = time_us();
+	int missing = 0;
+
+	if (cache.mutex != NULL)
+		apr_thread_mutex_lock(cache.mutex);
+
+	for (int i = 0; i < count; i++)
+	{
+		Sender *sender = &senders[i];
+		if (cache.mutex == NULL || !find_sender(sender, now))
+		{
+			sender->userId = 0;
+			sender->name[0] = '\0';
+			missing++;
+		}
+	}
+
+	if (cache.mutex != NULL)
+		apr_thread_mutex_unlock(cache.mutex);
+
+	// then one query per batch of the senders missing
+	for (int i = 0; i < count && missing > 0; i += LOAD_BATCH)
+	{
+		int n = count - i < LOAD_BATCH ? count - i : LOAD_BATCH;
+		errno_t e = load_senders(dbc, senders + i, n, now);
+		if (e != 0)
+			return e;
+	}
+	return 0;
+}
@@ -0,0 +1,168 @@
+#include <ctype.h>
+#include <openssl/evp.h>
+#include "../includes/db_pool.h"
+#include "../includes/voice_cache.h"
+
+/* followed by the whole key, in base 32 to fit the 64 characters
+ * of a lock name, for a site name of up to 7 characters */
+#define VOICE_LOCK __LIB__ "-tts-"
+#define VOICE_LOCK_STORE 65
+
+/* Hash the text as if its spaces were single, and without those at the ends.
+ * Return false if the digest failed. */
+static bool hash_words(EVP_MD_CTX *ctx, const char *text)
+{
+	bool ok = true;
+	bool space = false;
+	const char *start = text;
+
+	while (isspace((unsigned char)*start))
+		start++;
+
+	for (const char *s = start; *s; s++)
+	{
+		if (isspace((unsigned char)*s))
+		{
+			if (!space)
+				ok = ok && EVP_DigestUpdate(ctx, start, (size_t)(s - start)) == 1;
+			space = true;
+			continue;
+		}
+		if (space)
+		{
+			ok = ok && EVP_DigestUpdate(ctx, " ", 1) == 1;
+			start = s;
+		}
+		space = false;
+	}
+	if (!space)
+		ok = ok && EVP_DigestUpdate(ctx, start, strlen(start)) == 1;
+	return ok;
+}
+
+errno_t voice_key(char key[VOICE_KEY_LENGTH + 1], struct tts_input info)
+{
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	key[0] = '\0'; // clear first
+
+	const char *model = str_empty(info.model) ? TTS_MODEL : info.model;
+	const char *voice = str_empty(info.voice) ? TTS_VOICE : info.voice;
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	if (ctx == NULL)
+		return ENOMEM;
+
+	bool ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1 &&
+		EVP_DigestUpdate(ctx, model, strlen(model) + 1) == 1 && // with the '\0' as separator
+		EVP_DigestUpdate(ctx, voice, strlen(voice) + 1) == 1 &&
+		hash_words(ctx, info.input) &&
+		EVP_DigestFinal_ex(ctx, hash, &length) == 1;
+	EVP_MD_CTX_free(ctx);
+
+	// a shorter key would be shared by unrelated texts
+	if (!ok || length * 2 < VOICE_KEY_LENGTH)
+	{
+		APP_LOG(LOG_ERROR, "Failed to hash the words of a speech");
+		return EIO;
+	}
+
+	for (unsigned int i = 0; i * 2 < VOICE_KEY_LENGTH; i++)
+		sprintf(key + i * 2, "%02x", hash[i]);
+	key[VOICE_KEY_LENGTH] = '\0';
+	return 0;
+}
+
+struct voice_file
+{
+	row_id_t fileId;
+	char *path;
+};
+
+static errno_t find_voice_callback(void *context, int argc, char **argv, char **columns)
+{
+	CHECK_SQL_CALLBACK(2);
+	struct voice_file *info = (struct voice_file *)context;
+	info->fileId = atoll(argv[0]);
+	str_copy(info->path, FILE_PATH_STORE, argv[1]);
+	return 0;
+}
+
+errno_t find_voice_file(DbContext *dbc, const char *key, row_id_t *fileId, char path[FILE_PATH_STORE])
+{
+	struct voice_file info = {0, path};
+	DbQuery query = {.dbc = dbc};
+
+	query.callback = find_voice_callback;
+	query.callback_context = &info;
+
+	query.sql = "SELECT f.Id, p.Path\n"
+		"FROM VoiceFiles AS v\n"
+		"JOIN Files AS f ON f.Id = v.FileId AND f.DateDeleted IS NULL\n"
+		"JOIN FilePaths AS p ON p.Id = f.Id\n"
+		"WHERE v.Hash = UNHEX(?)\n";
+
+	JsonValue argv[1];
+	argv[query.argc++] = json_new_str(key, false);
+
+	errno_t e = sql_exec(&query, argv);
+	if (e != 0)
+		return e;
+
+	*fileId = info.fileId;
+	return info.fileId == 0 ? ENOENT : 0;
+}
+
+errno_t add_voice_file(DbContext *dbc, const char *key, row_id_t fileId)
+{
+	if (strlen(key) != VOICE_KEY_LENGTH)
+		return EINVAL; // else given to other words
+
+	DbQuery query = {.dbc = dbc};
+	query.sql = "INSERT INTO VoiceFiles (Hash, FileId) VALUES (UNHEX(?), ?)\n"
+		"ON DUPLICATE KEY UPDATE FileId = VALUES(FileId)\n";
+
+	JsonValue argv[2];
+	argv[query.argc++] = json_new_str(key, false);
+	argv[query.argc++] = json_new_long(fileId, false);
+
+	return sql_exec(&query, argv);
+}
+
+/* The lock of the key, its hex digits taken 5 bits at a time */
+static const char *voice_lock_name(char name[VOICE_LOCK_STORE], const char *key)
+{
+	static const char digits[] = "0123456789abcdefghijklmnopqrstuv";
+	char *n = name + snprintf(name, VOICE_LOCK_STORE, "%s", VOICE_LOCK);
+	char *end = name + VOICE_LOCK_STORE - 1;
+
+	unsigned bits = 0, count = 0;
+	for (const char *k = key; *k && n < end; k++)
+	{
+		unsigned c = (unsigned char)tolower((unsigned char)*k);
+		bits = (bits << 4 | (isdigit((int)c) ? c - '0' : c - 'a' + 10)) & 0xff;
+		count += 4;
+		if (count >= 5)
+		{
+			count -= 5;
+			*n++ = digits[(bits >> count) & 31];
+		}
+	}
+	if (count > 0 && n < end)
+		*n++ = digits[(bits << (5 - count)) & 31];
+
+	*n = '\0';
+	return name;
+}
+
+errno_t lock_voice(DbContext *dbc, const char *key, int seconds)
+{
+	char name[VOICE_LOCK_STORE];
+	return db_lock(dbc, voice_lock_name(name, key), seconds);
+}
+
+void unlock_voice(DbContext *dbc, const char *key)
+{
+	char name[VOICE_LOCK_STORE];
+	db_unlock(dbc, voice_lock_name(name, key));
+}
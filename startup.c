@@ -1,4 +1,9 @@
 #include "controllers/base.h"
+#include "includes/ai_queue.h"
+#include "includes/db_pool.h"
+#include "includes/http_audit.h"
+#include "includes/room_notify.h"
+#include "includes/senders.h"
 
 /* Called by only one server process at a time to avoid a race condition. */
 static apr_status_t prepare_database(HttpContext *c)
@@ -10,11 +15,27 @@ static apr_status_t prepare_database(HttpContext *c)
 /* Called only by the first HTTP request received by the server process. */
 static apr_status_t prepare_process(HttpContext *c)
 {
-	(void)c; // unused for now
 	register_account_controller();
 	register_message_controller();
 	register_room_controller();
 	register_file_upload_controller();
+
+	errno_t e = db_pool_init(c->request->server->process->pool);
+	if (e != 0)
+		return errno_to_status_code(e);
+
+	// without it, clients just do not get to wait for changes
+	room_notify_init(c->request->server->process->pool);
+
+	// without it, every page of messages looks up its senders
+	senders_init(c->request->server->process->pool);
+
+	// without it, outgoing HTTP requests are not recorded
+	http_audit_init(c->request->server->process->pool);
+
+	// without it, AI replies are given by the other processes
+	ai_queue_init(c->request->server->process->pool);
+
 	return errno_to_status_code(errno);
 }
 
@@ -25,7 +46,7 @@ apr_status_t http_request_handler(request_rec *r)
 	http_context_init(c, r, NULL);
 
 	// below must come right after above
-	c->dbc = db_context_init(DBMS_MySQL, NULL);
+	db_pool_acquire(&c->dbc);
 
 	apr_status_t status = startup_init(c, prepare_database, prepare_process);
 
@@ -44,6 +65,9 @@ apr_status_t http_request_handler(request_rec *r)
 	if (0 < status && status < 200) // should never happen
 		APP_LOG(LOG_ERROR, "Invalid status code: %d", status);
 
+	// give back the connection, unless it may be broken
+	db_pool_release(&c->dbc, status < HTTP_INTERNAL_SERVER_ERROR);
+
 	http_context_cleanup(c);
 	return status;
 }